@@ -0,0 +1,585 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "cbor.h"
+
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBOR_INDEFINITE 31
+
+/*
+ * Keys sent as integers. Append only - never reorder or remove a key, the
+ * position is what clients see. The keys repeated in every entry of the
+ * big lists come first, numbers below 24 fit in one byte.
+ */
+static const char *const cbor_keys[] = {
+  "Error",                      /* 0 */
+  "Results",
+  "RunCommand",
+  "RunCommands",
+  "cmd",
+  "args",
+  "pid",
+  "user",
+  "name",
+  "state",
+  "cpu",                        /* 10 */
+  "rss",
+  "swap",
+  "gpio",
+  "value",
+  "direction",
+  "id",
+  "type",
+  "temp",
+  "crc",
+  "age",                        /* 20 */
+  "timestamp",
+  "remote",
+  "code",
+  "Processes",
+  "ProcessesDelta",
+  "Seq",
+  "base",
+  "seq",
+  "added",
+  "removed",                    /* 30 */
+  "changed",
+  "GPIOState",
+  "Revision",
+  "GPIOEvent",
+  "TempSensors",
+  "Statistics",
+  "kernel",
+  "uptime",
+  "serial",
+  "mac_addr",                   /* 40 */
+  "used_space",
+  "free_space",
+  "ram_usage",
+  "swap_usage",
+  "cpu_load",
+  "cpu_temp",
+  "cpu_usage",
+  "cpu_usage_10s",
+  "cpu_usage_60s",
+  "cpu_cores",                  /* 50 */
+  "Notification",
+  "Subscribed",
+  "Unsubscribed",
+  "interval",
+  "IRSequence",
+  "status",
+  "error",
+  "Macro",
+  "IRMacros",
+  "StatisticsHistory",                  /* 60 */
+  "width",
+  "points",
+  "t",
+  "load",
+  "disk_usage",
+  "NotificationsResumed",
+  "since",
+  "first",
+  "last",
+};
+
+struct cbor_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+};
+
+
+/*
+ * cbor_key_id()
+ *
+ * Returns the number of 'key' or -1 if it is not in the table.
+ */
+int
+cbor_key_id (const char *key)
+{
+  static gsize once = 0;
+  static GHashTable *ids;
+  gpointer id;
+  guint i;
+
+  if (g_once_init_enter (&once))
+    {
+      ids = g_hash_table_new (g_str_hash, g_str_equal);
+      for (i = 0; i < G_N_ELEMENTS (cbor_keys); i++)
+        g_hash_table_insert (ids, (gpointer) cbor_keys[i], GUINT_TO_POINTER (i + 1));
+      g_once_init_leave (&once, 1);
+    }
+
+  id = g_hash_table_lookup (ids, key);
+  return id ? (int) GPOINTER_TO_UINT (id) - 1 : -1;
+}
+
+
+/*
+ * cbor_append_head()
+ *
+ * Major type and argument, in the shortest form.
+ */
+int
+cbor_append_head (struct msgbuf *b, unsigned int major, uint64_t value)
+{
+  unsigned char head[9];
+  size_t n, i;
+
+  if (value < 24)
+    {
+      head[0] = major << 5 | value;
+      return msgbuf_append (b, head, 1);
+    }
+
+  if (value <= 0xff)
+    {
+      head[0] = major << 5 | 24;
+      n = 1;
+    }
+  else if (value <= 0xffff)
+    {
+      head[0] = major << 5 | 25;
+      n = 2;
+    }
+  else if (value <= 0xffffffff)
+    {
+      head[0] = major << 5 | 26;
+      n = 4;
+    }
+  else
+    {
+      head[0] = major << 5 | 27;
+      n = 8;
+    }
+
+  for (i = n; i > 0; i--, value >>= 8)
+    head[i] = value & 0xff;
+
+  return msgbuf_append (b, head, n + 1);
+}
+
+
+/*
+ * cbor_append_text()
+ *
+ * 'text' has to be valid UTF-8.
+ */
+int
+cbor_append_text (struct msgbuf *b, const char *text, size_t len)
+{
+  if (cbor_append_head (b, CBOR_TEXT, len) < 0)
+    return -1;
+  return msgbuf_append (b, text, len);
+}
+
+
+/*
+ * cbor_append_key()
+ *
+ * As its number if the table has it.
+ */
+int
+cbor_append_key (struct msgbuf *b, const char *key)
+{
+  int id = cbor_key_id (key);
+
+  if (id >= 0)
+    return cbor_append_head (b, CBOR_UINT, id);
+  return cbor_append_text (b, key, strlen (key));
+}
+
+
+/*
+ * cbor_append_int()
+ */
+int
+cbor_append_int (struct msgbuf *b, int64_t value)
+{
+  if (value >= 0)
+    return cbor_append_head (b, CBOR_UINT, value);
+  return cbor_append_head (b, CBOR_NEGINT, -1 - value);
+}
+
+
+/*
+ * cbor_append_real()
+ *
+ * As a single precision float whenever that loses nothing - most readings
+ * do.
+ */
+int
+cbor_append_real (struct msgbuf *b, double value)
+{
+  unsigned char data[9];
+  uint64_t bits64;
+  uint32_t bits32;
+  float f = value;
+  int i;
+
+  if ((double) f == value)
+    {
+      memcpy (&bits32, &f, sizeof (bits32));
+      data[0] = 0xfa;
+      for (i = 4; i > 0; i--, bits32 >>= 8)
+        data[i] = bits32 & 0xff;
+      return msgbuf_append (b, data, 5);
+    }
+
+  memcpy (&bits64, &value, sizeof (bits64));
+  data[0] = 0xfb;
+  for (i = 8; i > 0; i--, bits64 >>= 8)
+    data[i] = bits64 & 0xff;
+  return msgbuf_append (b, data, 9);
+}
+
+
+static int
+cbor_append_value (struct msgbuf *b, const json_t *json)
+{
+  unsigned char simple;
+  const char *key;
+  json_t *value;
+  size_t i;
+
+  switch (json_typeof (json))
+    {
+    case JSON_OBJECT:
+      if (cbor_append_head (b, CBOR_MAP, json_object_size (json)) < 0)
+        return -1;
+      json_object_foreach ((json_t *) json, key, value)
+        if (cbor_append_key (b, key) < 0 || cbor_append_value (b, value) < 0)
+          return -1;
+      return 0;
+
+    case JSON_ARRAY:
+      if (cbor_append_head (b, CBOR_ARRAY, json_array_size (json)) < 0)
+        return -1;
+      for (i = 0; i < json_array_size (json); i++)
+        if (cbor_append_value (b, json_array_get (json, i)) < 0)
+          return -1;
+      return 0;
+
+    case JSON_STRING:
+      return cbor_append_text (b, json_string_value (json), strlen (json_string_value (json)));
+
+    case JSON_INTEGER:
+      return cbor_append_int (b, json_integer_value (json));
+
+    case JSON_REAL:
+      return cbor_append_real (b, json_real_value (json));
+
+    case JSON_TRUE:
+      simple = CBOR_TRUE;
+      break;
+
+    case JSON_FALSE:
+      simple = CBOR_FALSE;
+      break;
+
+    default:
+      simple = CBOR_NULL;
+      break;
+    }
+
+  return msgbuf_append (b, &simple, 1);
+}
+
+
+/*
+ * cbor_append_json()
+ *
+ * Same contract as msgbuf_append_json().
+ */
+int
+cbor_append_json (struct msgbuf *b, const json_t *json)
+{
+  size_t len = b->len;
+
+  if (cbor_append_value (b, json) < 0)
+    {
+      b->len = len;
+      return -1;
+    }
+
+  return b->len - len;
+}
+
+
+/*
+ * cbor_read_head()
+ *
+ * 'info' is left at CBOR_INDEFINITE for an indefinite length item or a
+ * break, 'value' is the argument otherwise.
+ */
+static int
+cbor_read_head (struct cbor_reader *r, unsigned int *major, unsigned int *info, uint64_t *value)
+{
+  size_t n, i;
+
+  if (r->p == r->end)
+    return -1;
+
+  *major = *r->p >> 5;
+  *info = *r->p & 0x1f;
+  r->p++;
+
+  if (*info < 24)
+    {
+      *value = *info;
+      return 0;
+    }
+
+  switch (*info)
+    {
+    case 24: n = 1; break;
+    case 25: n = 2; break;
+    case 26: n = 4; break;
+    case 27: n = 8; break;
+    case CBOR_INDEFINITE:
+      *value = 0;
+      return 0;
+    default:
+      return -1;
+    }
+
+  if ((size_t) (r->end - r->p) < n)
+    return -1;
+
+  for (*value = 0, i = 0; i < n; i++)
+    *value = *value << 8 | *r->p++;
+
+  return 0;
+}
+
+
+static double
+cbor_half_to_double (unsigned int half)
+{
+  int exponent = (half >> 10) & 0x1f;
+  int mantissa = half & 0x3ff;
+  double value;
+
+  if (exponent == 0)
+    value = ldexp (mantissa, -24);
+  else if (exponent != 31)
+    value = ldexp (mantissa + 1024, exponent - 25);
+  else
+    value = mantissa == 0 ? INFINITY : NAN;
+
+  return half & 0x8000 ? -value : value;
+}
+
+
+static json_t *cbor_read_value (struct cbor_reader *r, int depth);
+
+
+/*
+ * cbor_read_key()
+ *
+ * Returns the key as a new string - integer keys are looked up in the
+ * table and the ones it doesn't have are kept as decimal strings.
+ */
+static char *
+cbor_read_key (struct cbor_reader *r)
+{
+  unsigned int major, info;
+  uint64_t value;
+  char *key;
+
+  if (cbor_read_head (r, &major, &info, &value) < 0 || info == CBOR_INDEFINITE)
+    return NULL;
+
+  if (major == CBOR_UINT)
+    return value < G_N_ELEMENTS (cbor_keys) ? g_strdup (cbor_keys[value]) :
+                                               g_strdup_printf ("%" G_GUINT64_FORMAT, value);
+
+  if (major != CBOR_TEXT || value > (uint64_t) (r->end - r->p))
+    return NULL;
+
+  key = g_strndup ((const char *) r->p, value);
+  r->p += value;
+  if (strlen (key) != value)
+    {
+      g_free (key);
+      return NULL;
+    }
+  return key;
+}
+
+
+static gboolean
+cbor_at_break (struct cbor_reader *r)
+{
+  if (r->p < r->end && *r->p == CBOR_BREAK)
+    {
+      r->p++;
+      return TRUE;
+    }
+  return FALSE;
+}
+
+
+static json_t *
+cbor_read_container (struct cbor_reader *r, unsigned int major, unsigned int info,
+                     uint64_t n, int depth)
+{
+  json_t *json, *value;
+  uint64_t i;
+  char *key;
+
+  json = major == CBOR_MAP ? json_object () : json_array ();
+  if (json == NULL)
+    return NULL;
+
+  for (i = 0; info == CBOR_INDEFINITE || i < n; i++)
+    {
+      if (info == CBOR_INDEFINITE && cbor_at_break (r))
+        break;
+
+      if (major == CBOR_ARRAY)
+        {
+          value = cbor_read_value (r, depth + 1);
+          if (value == NULL || json_array_append_new (json, value) < 0)
+            goto error;
+          continue;
+        }
+
+      key = cbor_read_key (r);
+      if (key == NULL)
+        goto error;
+      value = cbor_read_value (r, depth + 1);
+      if (value == NULL || json_object_set_new (json, key, value) < 0)
+        {
+          g_free (key);
+          goto error;
+        }
+      g_free (key);
+    }
+
+  return json;
+
+error:
+  json_decref (json);
+  return NULL;
+}
+
+
+static json_t *
+cbor_read_value (struct cbor_reader *r, int depth)
+{
+  unsigned int major, info;
+  uint64_t value;
+  uint32_t bits;
+  json_t *json;
+  char *text;
+  float f;
+  double d;
+
+  if (depth > CBOR_MAX_DEPTH || cbor_read_head (r, &major, &info, &value) < 0)
+    return NULL;
+
+  /* only containers may have an indefinite length */
+  if (info == CBOR_INDEFINITE && major != CBOR_ARRAY && major != CBOR_MAP)
+    return NULL;
+
+  switch (major)
+    {
+    case CBOR_UINT:
+      return value <= INT64_MAX ? json_integer (value) : NULL;
+
+    case CBOR_NEGINT:
+      return value <= INT64_MAX ? json_integer (-1 - (json_int_t) value) : NULL;
+
+    case CBOR_TEXT:
+      if (value > (uint64_t) (r->end - r->p))
+        return NULL;
+      /* json_string() refuses invalid UTF-8 and embedded NULs */
+      text = g_strndup ((const char *) r->p, value);
+      r->p += value;
+      json = strlen (text) == value ? json_string (text) : NULL;
+      g_free (text);
+      return json;
+
+    case CBOR_ARRAY:
+    case CBOR_MAP:
+      /* every item takes at least a byte */
+      if (info != CBOR_INDEFINITE && value > (uint64_t) (r->end - r->p))
+        return NULL;
+      return cbor_read_container (r, major, info, value, depth);
+
+    case CBOR_TAG:
+      /* tags add nothing JSON could carry */
+      return cbor_read_value (r, depth + 1);
+
+    case CBOR_SIMPLE:
+      switch (info)
+        {
+        case 20:
+          return json_false ();
+        case 21:
+          return json_true ();
+        case 22:
+        case 23:
+          return json_null ();
+        case 25:
+          return json_real (cbor_half_to_double (value));
+        case 26:
+          bits = value;
+          memcpy (&f, &bits, sizeof (f));
+          return json_real (f);
+        case 27:
+          memcpy (&d, &value, sizeof (d));
+          return json_real (d);
+        }
+      return NULL;
+
+    default:
+      /* byte strings have no JSON form */
+      return NULL;
+    }
+}
+
+
+/*
+ * cbor_load()
+ *
+ * Parses one complete data item, returns NULL if 'data' is anything else.
+ */
+json_t *
+cbor_load (const unsigned char *data, size_t len)
+{
+  struct cbor_reader r = { data, data + len };
+  json_t *json;
+
+  json = cbor_read_value (&r, 0);
+  if (json != NULL && r.p != r.end)
+    {
+      json_decref (json);
+      return NULL;
+    }
+
+  return json;
+}
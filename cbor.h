@@ -0,0 +1,66 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __CBOR_H
+#define __CBOR_H
+
+#include <stdint.h>
+#include <jansson.h>
+#include "msgbuf.h"
+
+/*
+ * CBOR (RFC 7049) form of the JSON messages, spoken on the binary
+ * subprotocol. Documents are the same trees as on the JSON protocol, but
+ * the object keys the server knows about go on the wire as small unsigned
+ * integers - the position of the key in the table in cbor.c - and any
+ * other key as a text string. Both forms are accepted on input.
+ *
+ * The key table is append only, a key keeps its number for good.
+ */
+#define CBOR_MAX_DEPTH 32
+
+/* major types */
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+/* single byte items */
+#define CBOR_ARRAY_BEGIN 0x9f                 /* indefinite length */
+#define CBOR_MAP_BEGIN   0xbf                 /* indefinite length */
+#define CBOR_FALSE       0xf4
+#define CBOR_TRUE        0xf5
+#define CBOR_NULL        0xf6
+#define CBOR_BREAK       0xff
+
+int cbor_key_id (const char *key);
+int cbor_append_head (struct msgbuf *b, unsigned int major, uint64_t value);
+int cbor_append_text (struct msgbuf *b, const char *text, size_t len);
+int cbor_append_key (struct msgbuf *b, const char *key);
+int cbor_append_int (struct msgbuf *b, int64_t value);
+int cbor_append_real (struct msgbuf *b, double value);
+
+int cbor_append_json (struct msgbuf *b, const json_t *json);
+json_t *cbor_load (const unsigned char *data, size_t len);
+
+#endif /* __CBOR_H */
@@ -9,28 +9,43 @@
 #include <dirent.h>
 #include <limits.h>
 #include <mntent.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/statfs.h>
 #include <sys/sysinfo.h>
 #include <sys/utsname.h>
 
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 struct devman_ctx *devman_ctx_init(void)
 {
 	struct devman_ctx *ctx;
-	ctx = malloc(sizeof(*ctx));
+	ctx = calloc(1, sizeof(*ctx));
 
 	if (ctx == NULL)
 		return NULL;
 
 	ctx->uname = malloc(sizeof(*ctx->uname));
 	ctx->sysinfo = malloc(sizeof(*ctx->sysinfo));
-	ctx->last_update = 0;
 
-	if (ctx->uname == NULL || ctx->sysinfo == NULL || devman_ctx_update(ctx) < 0) {
+	ctx->refresh[DEVMAN_UNAME] = DEVMAN_REFRESH_ONCE;
+	ctx->refresh[DEVMAN_SYSINFO] = 1000;
+	ctx->refresh[DEVMAN_MOUNTS] = DEVMAN_REFRESH_ON_CHANGE;
+	ctx->refresh[DEVMAN_SERIAL] = DEVMAN_REFRESH_ONCE;
+
+	if (ctx->uname == NULL || ctx->sysinfo == NULL) {
 		free(ctx->uname);
 		free(ctx->sysinfo);
 		free(ctx);
@@ -40,48 +55,184 @@ struct devman_ctx *devman_ctx_init(void)
 	return ctx;
 }
 
+static void free_mounts(struct devman_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nmounts; ++i) {
+		free(ctx->mounts[i].fsname);
+		free(ctx->mounts[i].dir);
+	}
+	free(ctx->mounts);
+	ctx->mounts = NULL;
+	ctx->nmounts = 0;
+}
+
 void devman_ctx_free(struct devman_ctx *ctx)
 {
 	assert(ctx);
 	free(ctx->uname);
 	free(ctx->sysinfo);
+	free(ctx->serial);
+	free_mounts(ctx);
+	if (ctx->mounts_fp)
+		endmntent(ctx->mounts_fp);
 	free(ctx);
 }
 
-int devman_ctx_update(struct devman_ctx *ctx)
+void devman_ctx_set_refresh(struct devman_ctx *ctx, enum devman_field field, int refresh)
 {
-	assert(ctx);
+	assert(ctx && field < _DEVMAN_FIELD_COUNT);
+	ctx->refresh[field] = refresh;
+}
 
-	time_t t = time(NULL);
+/* The kernel flags /proc/self/mounts with POLLPRI when the mount table changes. */
+static bool mounts_changed(struct devman_ctx *ctx)
+{
+	struct pollfd pfd;
 
-	/*TODO: this should be configurable. */
-	if (t - ctx->last_update < 120)
-		return 0;
+	if (ctx->mounts_fp == NULL)
+		return true;
+
+	pfd.fd = fileno(ctx->mounts_fp);
+	pfd.events = POLLPRI;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR));
+}
 
-	if (uname(ctx->uname) < 0)
+static int read_mounts(struct devman_ctx *ctx)
+{
+	struct mntent *ent;
+	void *tmp;
+	int size = 0;
+
+	if (ctx->mounts_fp == NULL) {
+		ctx->mounts_fp = setmntent("/proc/self/mounts", "r");
+		if (ctx->mounts_fp == NULL)
+			return -1;
+	}
+
+	free_mounts(ctx);
+	rewind(ctx->mounts_fp);
+
+	for (ent = getmntent(ctx->mounts_fp); ent; ent = getmntent(ctx->mounts_fp)) {
+		if (ctx->nmounts == size) {
+			size = size ? size * 2 : 32;
+			tmp = realloc(ctx->mounts, size * sizeof(*ctx->mounts));
+			if (tmp == NULL)
+				return -1;
+			ctx->mounts = tmp;
+		}
+		ctx->mounts[ctx->nmounts].fsname = strdup(ent->mnt_fsname);
+		ctx->mounts[ctx->nmounts].dir = strdup(ent->mnt_dir);
+		++ctx->nmounts;
+	}
+
+	return 0;
+}
+
+static int read_rpi_serial(struct devman_ctx *ctx)
+{
+	FILE *fp;
+	char line[LINE_MAX] = {0,};
+	char serial[LINE_MAX];
+
+	fp = fopen("/proc/cpuinfo", "r");
+	if (fp == NULL)
 		return -1;
 
-	if (sysinfo(ctx->sysinfo) < 0)
+	while (fgets(line, LINE_MAX, fp))
+		if (sscanf(line, "%*[Ss]erial : %s\n", serial) == 1) {
+			free(ctx->serial);
+			ctx->serial = strdup(serial);
+			break;
+		}
+
+	if (ferror(fp)) {
+		fclose(fp);
 		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int fill_field(struct devman_ctx *ctx, enum devman_field field)
+{
+	switch (field) {
+	case DEVMAN_UNAME:
+		return uname(ctx->uname);
+	case DEVMAN_SYSINFO:
+		return sysinfo(ctx->sysinfo);
+	case DEVMAN_MOUNTS:
+		return read_mounts(ctx);
+	case DEVMAN_SERIAL:
+		return read_rpi_serial(ctx);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/* Fills the field if it has never been filled or its refresh policy says so. */
+int devman_ctx_refresh(struct devman_ctx *ctx, enum devman_field field)
+{
+	int64_t t;
+	bool due;
+
+	assert(ctx && field < _DEVMAN_FIELD_COUNT);
+
+	t = now_ms();
+
+	if (ctx->last_update[field] == 0)
+		due = true;
+	else if (ctx->refresh[field] == DEVMAN_REFRESH_ONCE)
+		due = false;
+	else if (ctx->refresh[field] == DEVMAN_REFRESH_ON_CHANGE)
+		due = field == DEVMAN_MOUNTS && mounts_changed(ctx);
+	else
+		due = t - ctx->last_update[field] >= ctx->refresh[field];
+
+	if (!due)
+		return 0;
+
+	if (fill_field(ctx, field) < 0)
+		return -1;
+
+	ctx->last_update[field] = t;
+	return 0;
+}
+
+int devman_ctx_update(struct devman_ctx *ctx)
+{
+	int i;
 
-	ctx->last_update = t;
+	assert(ctx);
+
+	for (i = 0; i < _DEVMAN_FIELD_COUNT; ++i)
+		if (devman_ctx_refresh(ctx, i) < 0)
+			return -1;
 
 	return 0;
 }
 
-char *get_kernel_version(const struct devman_ctx *ctx)
+char *get_kernel_version(struct devman_ctx *ctx)
 {
 	assert(ctx);
+	if (devman_ctx_refresh(ctx, DEVMAN_UNAME) < 0)
+		return NULL;
 	return strdup(ctx->uname->release);
 }
 
-char *get_uptime_str(const struct devman_ctx *ctx)
+char *get_uptime_str(struct devman_ctx *ctx)
 {
 	unsigned int hrs, min, sec;
 	char *uptime;
 
 	assert(ctx);
 
+	if (devman_ctx_refresh(ctx, DEVMAN_SYSINFO) < 0)
+		return NULL;
+
 	uptime = malloc(LINE_MAX);
 	if (uptime == NULL)
 		return NULL;
@@ -95,12 +246,15 @@ char *get_uptime_str(const struct devman_ctx *ctx)
 	return uptime;
 }
 
-char *get_cpuload_str(const struct devman_ctx *ctx)
+char *get_cpuload_str(struct devman_ctx *ctx)
 {
 	char *load; 
 
 	assert(ctx);
-		
+
+	if (devman_ctx_refresh(ctx, DEVMAN_SYSINFO) < 0)
+		return NULL;
+
 	load = malloc(LINE_MAX);
 	if (load == NULL)
 		return NULL;
@@ -113,31 +267,12 @@ char *get_cpuload_str(const struct devman_ctx *ctx)
 	return load;
 }
 
-char *get_rpi_serial(void)
+char *get_rpi_serial(struct devman_ctx *ctx)
 {
-	FILE *fp;
-	char *serial;
-	char line[LINE_MAX] = {0,};
-
-	fp = fopen("/proc/cpuinfo", "r");
-	if (fp == NULL)
+	assert(ctx);
+	if (devman_ctx_refresh(ctx, DEVMAN_SERIAL) < 0 || ctx->serial == NULL)
 		return NULL;
-
-	serial = malloc(LINE_MAX * sizeof(*serial));
-	if (serial == NULL)
-		goto end;
-
-	while (fgets(line, LINE_MAX, fp))
-		if (sscanf(line, "%*[Ss]erial : %s\n", serial))
-			break;
-
-	if (ferror(fp)) {
-		free(serial);
-		serial = NULL;
-	}
-end:
-	fclose(fp);
-	return serial;
+	return strdup(ctx->serial);
 }
 
 int get_rpi_cpu_temp(void)
@@ -225,31 +360,29 @@ fail:
 }
 
 /*TODO: filter should accept mntent structure instead of char *. */
-int get_df(char ***filesystems, bool (*filter)(const char *))
+int get_df(struct devman_ctx *ctx, char ***filesystems, bool (*filter)(const char *))
 {
 	struct statfs sfs;
-	struct mntent *ent;
+	struct devman_mount *ent;
 	uint64_t bytes_used, bytes_free;
-	int n = 0, r = 0;
+	int i, r = 0;
 	char **arr = NULL;
-	FILE *fp = setmntent("/etc/mtab", "r");
-	if (fp == NULL)
-		return -1;
 
-	for (ent = getmntent(fp); ent; ent = getmntent(fp))
-		++n;
+	assert(ctx);
 
-	arr = malloc(n * sizeof(*arr));
-	if (arr == NULL)
-		goto fail;
+	if (devman_ctx_refresh(ctx, DEVMAN_MOUNTS) < 0)
+		return -1;
 
-	rewind(fp);
+	arr = malloc(ctx->nmounts * sizeof(*arr));
+	if (arr == NULL)
+		return -1;
 
-	for (ent = getmntent(fp); ent; ent = getmntent(fp)) {
-		if (filter && !filter(ent->mnt_dir))
+	for (i = 0; i < ctx->nmounts; ++i) {
+		ent = &ctx->mounts[i];
+		if (filter && !filter(ent->dir))
 			continue;
 
-		if (statfs(ent->mnt_dir, &sfs) < 0 )
+		if (statfs(ent->dir, &sfs) < 0 )
 			goto fail;
 
 		arr[r] = malloc(LINE_MAX);
@@ -258,25 +391,25 @@ int get_df(char ***filesystems, bool (*filter)(const char *))
 
 		bytes_free = sfs.f_bfree * sfs.f_bsize;
 		bytes_used = (sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
-		sprintf(arr[r++], "%s %s %"PRIu64" %"PRIu64, ent->mnt_fsname, ent->mnt_dir, bytes_used, bytes_free);
+		sprintf(arr[r++], "%s %s %"PRIu64" %"PRIu64, ent->fsname, ent->dir, bytes_used, bytes_free);
 	}
 	*filesystems = realloc(arr, r * sizeof(*arr));
-	if (*filesystems == NULL)
+	if (*filesystems == NULL && r > 0)
 		goto fail;
-	endmntent(fp);
 	return r;
 fail:
-	endmntent(fp);
-	if (arr)
-		FREE_ARRAY_ELEMENTS(arr, n, r);
+	FREE_ARRAY_ELEMENTS(arr, i, r);
 	free(arr);
 	return -1;
 };
 
-double total_mem_usage(const struct devman_ctx *ctx, bool swap)
+double total_mem_usage(struct devman_ctx *ctx, bool swap)
 {
 	assert(ctx);
-	
+
+	if (devman_ctx_refresh(ctx, DEVMAN_SYSINFO) < 0)
+		return -1.0;
+
 	if (swap)
 		return (double) (ctx->sysinfo->totalswap - ctx->sysinfo->freeswap)
 			/ ctx->sysinfo->totalswap * 100.0;
@@ -299,51 +432,169 @@ enum {
 	_CPU_STATE_COUNT
 };
 
-#define CPU_STATS_TO_ARR(fp, arr) \
-		fscanf(fp, "cpu %"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"%"SCNu64"\n", \
-				&arr[0], &arr[1], &arr[2], &arr[3], &arr[4], &arr[5], &arr[6], &arr[7], &arr[8], &arr[9])
+#define TS_TO_MS(ts) ((int64_t)(ts).tv_sec * 1000 + (ts).tv_nsec / 1000000)
+
+struct cpu_sampler {
+	int fd;
+	int ncpus;
+	unsigned int head;		/* slot of the next snapshot */
+	unsigned int count;		/* number of valid snapshots */
+	struct timespec ts[CPU_SAMPLER_DEPTH];
+	uint64_t *work;			/* CPU_SAMPLER_DEPTH * (ncpus + 1) */
+	uint64_t *total;		/* slot-major, index 0 is the "cpu" line */
+};
 
-double total_cpu_usage(void)
+struct cpu_sampler *cpu_sampler_new(void)
 {
-	FILE *fp;
-	int r;
-	uint64_t total1, work1, total2, work2;
-	uint64_t vals1[_CPU_STATE_COUNT] = {0,};
-	uint64_t vals2[_CPU_STATE_COUNT] = {0,};
+	struct cpu_sampler *s;
+	long n;
 
-	fp = fopen("/proc/stat","r");
-	if (fp == NULL)
-		return -1.0;
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	if (n < 1)
+		n = 1;
 
-	r = CPU_STATS_TO_ARR(fp, vals1);
-	if (r < 4 || (r == EOF && ferror(fp)))
-		goto fail;
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
 
-	rewind(fp);
-	sleep(1);
-	fflush(fp);
+	s->ncpus = n;
+	s->work = calloc(CPU_SAMPLER_DEPTH * (n + 1), sizeof(*s->work));
+	s->total = calloc(CPU_SAMPLER_DEPTH * (n + 1), sizeof(*s->total));
+	s->fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
 
-	r = CPU_STATS_TO_ARR(fp, vals2);
-	if (r < 4 || (r == EOF && ferror(fp)))
-		goto fail;
+	if (s->work == NULL || s->total == NULL || s->fd < 0) {
+		cpu_sampler_free(s);
+		return NULL;
+	}
 
-	fclose(fp);
+	return s;
+}
+
+void cpu_sampler_free(struct cpu_sampler *s)
+{
+	if (s == NULL)
+		return;
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->work);
+	free(s->total);
+	free(s);
+}
+
+int cpu_sampler_ncpus(const struct cpu_sampler *s)
+{
+	assert(s);
+	return s->ncpus;
+}
 
-	work1 = vals1[CPU_STATE_USER] + vals1[CPU_STATE_NICE] + vals1[CPU_STATE_SYSTEM] +
-		vals1[CPU_STATE_IRQ] + vals1[CPU_STATE_SOFTIRQ] + vals1[CPU_STATE_STEAL] +
-		vals1[CPU_STATE_GUEST] + vals1[CPU_STATE_GUEST_NICE];
-	total1 = work1 + vals1[CPU_STATE_IDLE]  + vals2[CPU_STATE_IOWAIT];
+/* Parses one "cpu..." line, returns the line index (0 for the aggregate) or -1. */
+static int parse_cpu_line(char **pos, uint64_t *work, uint64_t *total)
+{
+	uint64_t vals[_CPU_STATE_COUNT] = {0,};
+	char *p = *pos, *end;
+	int i, idx = 0;
 
-	work2 = vals2[CPU_STATE_USER] + vals2[CPU_STATE_NICE] + vals2[CPU_STATE_SYSTEM] +
-		vals2[CPU_STATE_IRQ] + vals2[CPU_STATE_SOFTIRQ] + vals2[CPU_STATE_STEAL] +
-		vals2[CPU_STATE_GUEST] + vals2[CPU_STATE_GUEST_NICE];
-	total2 = work2 + vals2[CPU_STATE_IDLE]  + vals2[CPU_STATE_IOWAIT];
+	if (strncmp(p, "cpu", 3) != 0)
+		return -1;
+	p += 3;
 
-	return (double)(work2 - work1) / (total2 - total1) * 100.0;
+	if (*p != ' ') {
+		idx = strtol(p, &end, 10) + 1;
+		p = end;
+	}
 
-fail:
-	r = errno;
-	fclose(fp);
-	errno = r;
-	return -1.0;
+	for (i = 0; i < _CPU_STATE_COUNT; ++i) {
+		vals[i] = strtoull(p, &end, 10);
+		if (end == p)
+			break;
+		p = end;
+	}
+	if (i < 4)
+		return -1;
+
+	*work = vals[CPU_STATE_USER] + vals[CPU_STATE_NICE] + vals[CPU_STATE_SYSTEM] +
+		vals[CPU_STATE_IRQ] + vals[CPU_STATE_SOFTIRQ] + vals[CPU_STATE_STEAL] +
+		vals[CPU_STATE_GUEST] + vals[CPU_STATE_GUEST_NICE];
+	*total = *work + vals[CPU_STATE_IDLE] + vals[CPU_STATE_IOWAIT];
+
+	p = strchr(p, '\n');
+	*pos = p ? p + 1 : p;
+	return idx;
+}
+
+int cpu_sampler_update(struct cpu_sampler *s)
+{
+	char buf[8192];
+	char *p;
+	ssize_t len;
+	uint64_t work, total;
+	uint64_t *w, *t;
+	int idx;
+
+	assert(s);
+
+	len = pread(s->fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	w = &s->work[s->head * (s->ncpus + 1)];
+	t = &s->total[s->head * (s->ncpus + 1)];
+	memset(w, 0, (s->ncpus + 1) * sizeof(*w));
+	memset(t, 0, (s->ncpus + 1) * sizeof(*t));
+
+	for (p = buf; p && *p; ) {
+		idx = parse_cpu_line(&p, &work, &total);
+		if (idx < 0)
+			break;
+		if (idx > s->ncpus)
+			continue;
+		w[idx] = work;
+		t[idx] = total;
+	}
+
+	if (t[0] == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &s->ts[s->head]);
+	s->head = (s->head + 1) % CPU_SAMPLER_DEPTH;
+	if (s->count < CPU_SAMPLER_DEPTH)
+		++s->count;
+
+	return 0;
+}
+
+double cpu_sampler_usage(const struct cpu_sampler *s, int cpu, unsigned int window)
+{
+	unsigned int newest, oldest, i, slot;
+	uint64_t dwork, dtotal;
+	int64_t since;
+
+	assert(s);
+
+	if (cpu < -1 || cpu >= s->ncpus || s->count < 2)
+		return -1.0;
+
+	newest = (s->head + CPU_SAMPLER_DEPTH - 1) % CPU_SAMPLER_DEPTH;
+	since = TS_TO_MS(s->ts[newest]) - window * 1000;
+
+	/* walk back to the youngest snapshot that covers the whole window */
+	oldest = newest;
+	for (i = 1; i < s->count; ++i) {
+		slot = (newest + CPU_SAMPLER_DEPTH - i) % CPU_SAMPLER_DEPTH;
+		oldest = slot;
+		if (TS_TO_MS(s->ts[slot]) <= since)
+			break;
+	}
+
+	newest = newest * (s->ncpus + 1) + cpu + 1;
+	oldest = oldest * (s->ncpus + 1) + cpu + 1;
+	dwork = s->work[newest] - s->work[oldest];
+	dtotal = s->total[newest] - s->total[oldest];
+	if (dtotal == 0)
+		return 0.0;
+
+	return (double)dwork / dtotal * 100.0;
 }
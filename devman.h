@@ -1,29 +1,77 @@
 #ifndef __DEVMAN_H
 #define __DEVMAN_H
+#include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
 
 struct utsname;
 struct sysinfo;
 
+/*
+ * Data sources cached by a devman_ctx. Each one is filled lazily on first
+ * access and then refreshed according to its own policy: a period in
+ * milliseconds, DEVMAN_REFRESH_ONCE (never refreshed) or
+ * DEVMAN_REFRESH_ON_CHANGE (refreshed when the kernel reports a change,
+ * only supported for the mount table).
+ */
+enum devman_field {
+	DEVMAN_UNAME,
+	DEVMAN_SYSINFO,
+	DEVMAN_MOUNTS,
+	DEVMAN_SERIAL,
+	_DEVMAN_FIELD_COUNT
+};
+
+#define DEVMAN_REFRESH_ONCE		-1
+#define DEVMAN_REFRESH_ON_CHANGE	-2
+
+struct devman_mount {
+	char *fsname;
+	char *dir;
+};
+
 struct devman_ctx {
 	struct utsname *uname;
 	struct sysinfo *sysinfo;
-	time_t last_update;
+	char *serial;
+	struct devman_mount *mounts;
+	int nmounts;
+	FILE *mounts_fp;
+	int refresh[_DEVMAN_FIELD_COUNT];
+	int64_t last_update[_DEVMAN_FIELD_COUNT];	/* monotonic ms, 0 if never */
 };
 
 struct devman_ctx *devman_ctx_init(void);
 void devman_ctx_free(struct devman_ctx *ctx);
+void devman_ctx_set_refresh(struct devman_ctx *ctx, enum devman_field field, int refresh);
+int devman_ctx_refresh(struct devman_ctx *ctx, enum devman_field field);
 int devman_ctx_update(struct devman_ctx *ctx);
 
-char *get_kernel_version(const struct devman_ctx *ctx);
-char *get_uptime_str(const struct devman_ctx *ctx);
-char *get_cpuload_str(const struct devman_ctx *ctx);
-char *get_rpi_serial(void);
+char *get_kernel_version(struct devman_ctx *ctx);
+char *get_uptime_str(struct devman_ctx *ctx);
+char *get_cpuload_str(struct devman_ctx *ctx);
+char *get_rpi_serial(struct devman_ctx *ctx);
 int get_rpi_cpu_temp(void);
 int get_netdevices(char ***devices, bool (*filter)(const char *));
-int get_df(char ***filesystems, bool (*filter)(const char *));
-double total_mem_usage(const struct devman_ctx *ctx, bool swap);
-double total_cpu_usage(void);
+int get_df(struct devman_ctx *ctx, char ***filesystems, bool (*filter)(const char *));
+double total_mem_usage(struct devman_ctx *ctx, bool swap);
+
+/*
+ * Background CPU usage sampler. cpu_sampler_update() takes one /proc/stat
+ * snapshot (aggregate and per-core lines) into a ring of CPU_SAMPLER_DEPTH
+ * slots and is meant to be called at a fixed interval. cpu_sampler_usage()
+ * answers from the ring without touching procfs; cpu == -1 means all cores,
+ * window is in seconds.
+ */
+#define CPU_SAMPLER_DEPTH 61
+
+struct cpu_sampler;
+
+struct cpu_sampler *cpu_sampler_new(void);
+void cpu_sampler_free(struct cpu_sampler *s);
+int cpu_sampler_update(struct cpu_sampler *s);
+int cpu_sampler_ncpus(const struct cpu_sampler *s);
+double cpu_sampler_usage(const struct cpu_sampler *s, int cpu, unsigned int window);
 
 #endif /* __DEVMAN_H */
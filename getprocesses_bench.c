@@ -0,0 +1,102 @@
+/*
+ * Micro-benchmark of the GetProcesses path: a process table snapshot, then
+ * the user name of every process - resolved with a getpwuid() per process
+ * as the server used to, and through uid_to_name().
+ *
+ *	cmake -DBUILD_BENCHMARKS=ON .. && make getprocesses-bench && ./getprocesses-bench
+ */
+#include "proctab.h"
+#include "uidcache.h"
+
+#include <pwd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ROUNDS		200
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static volatile const char *sink;
+
+static void names_getpwuid(const struct proc_snapshot *snap)
+{
+	struct passwd *pw;
+	int i;
+
+	for (i = 0; i < snap->n; ++i) {
+		pw = getpwuid(snap->entries[i].uid);
+		sink = pw ? pw->pw_name : NULL;
+	}
+}
+
+static void names_cached(const struct proc_snapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < snap->n; ++i)
+		sink = uid_to_name(snap->entries[i].uid);
+}
+
+/* Time of one round, snapshot and names, in ns; 'names' is the time of the names alone. */
+static int64_t run(struct proc_history *h, void (*resolve)(const struct proc_snapshot *),
+		int64_t *names, int *n)
+{
+	const struct proc_snapshot *snap;
+	int64_t t0, t1, total = 0;
+	int i;
+
+	*names = 0;
+	for (i = 0; i < ROUNDS; ++i) {
+		t0 = now_ns();
+		snap = proc_history_take(h, 0);
+		if (snap == NULL)
+			return -1;
+		t1 = now_ns();
+		resolve(snap);
+		*names += now_ns() - t1;
+		total += now_ns() - t0;
+		*n = snap->n;
+	}
+
+	*names /= ROUNDS;
+	return total / ROUNDS;
+}
+
+int main(void)
+{
+	struct proc_history *h;
+	int64_t t_pw, t_cache, n_pw, n_cache;
+	int n;
+
+	h = proc_history_new();
+	if (h == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	t_pw = run(h, names_getpwuid, &n_pw, &n);
+	/* a first run fills the cache */
+	run(h, names_cached, &n_cache, &n);
+	t_cache = run(h, names_cached, &n_cache, &n);
+	proc_history_free(h);
+
+	if (t_pw < 0 || t_cache < 0) {
+		fprintf(stderr, "can't list processes\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d processes, %d rounds\n", n, ROUNDS);
+	printf("             %12s %12s\n", "us/round", "names us");
+	printf("getpwuid()   %12.1f %12.1f\n", t_pw / 1e3, n_pw / 1e3);
+	printf("uid_to_name()%12.1f %12.1f\n", t_cache / 1e3, n_cache / 1e3);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+#include "gpio.h"
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char sysfs_root[256] = "/sys/class/gpio";
+
+void gpio_set_sysfs_root(const char *root)
+{
+	snprintf(sysfs_root, sizeof(sysfs_root), "%s", root);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int cmp_gpio(const void *a, const void *b)
+{
+	const int *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* Lists the exported pins (gpioN links), sorted. Returns their number or -1. */
+static int list_exported(int **gpios)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int *arr = NULL;
+	void *tmp;
+	int n = 0, size = 0;
+
+	dir = opendir(sysfs_root);
+	if (dir == NULL)
+		return -1;
+
+	for (ent = readdir(dir); ent; ent = readdir(dir)) {
+		if (ent->d_type != DT_LNK || strncmp(ent->d_name, "gpio", 4) != 0 ||
+		    !isdigit((unsigned char) ent->d_name[4]))
+			continue;
+
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			tmp = realloc(arr, size * sizeof(*arr));
+			if (tmp == NULL) {
+				free(arr);
+				closedir(dir);
+				return -1;
+			}
+			arr = tmp;
+		}
+		arr[n++] = atoi(ent->d_name + 4);
+	}
+
+	closedir(dir);
+	qsort(arr, n, sizeof(*arr), cmp_gpio);
+	*gpios = arr;
+	return n;
+}
+
+static void close_pins(struct gpio_table *t)
+{
+	int i;
+
+	for (i = 0; i < t->npins; ++i) {
+		close(t->pins[i].value_fd);
+		close(t->pins[i].direction_fd);
+	}
+	free(t->pins);
+	t->pins = NULL;
+	t->npins = 0;
+}
+
+struct gpio_table *gpio_table_new(void)
+{
+	return calloc(1, sizeof(struct gpio_table));
+}
+
+void gpio_table_free(struct gpio_table *t)
+{
+	if (t == NULL)
+		return;
+	close_pins(t);
+	free(t);
+}
+
+int gpio_table_rescan(struct gpio_table *t)
+{
+	char path[PATH_MAX];
+	struct gpio_pin *pin;
+	int *gpios;
+	int i, n;
+
+	assert(t);
+
+	n = list_exported(&gpios);
+	if (n < 0)
+		return -1;
+
+	close_pins(t);
+	t->last_scan = now_ms();
+	t->pins = calloc(n ? n : 1, sizeof(*t->pins));
+	if (t->pins == NULL) {
+		free(gpios);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		pin = &t->pins[t->npins];
+		pin->gpio = gpios[i];
+
+		snprintf(path, PATH_MAX, "%s/gpio%d/value", sysfs_root, pin->gpio);
+		pin->value_fd = open(path, O_RDWR | O_CLOEXEC);
+		if (pin->value_fd < 0)
+			pin->value_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (pin->value_fd < 0)
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/gpio%d/direction", sysfs_root, pin->gpio);
+		pin->direction_fd = open(path, O_RDWR | O_CLOEXEC);
+		if (pin->direction_fd < 0)
+			pin->direction_fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (pin->direction_fd < 0) {
+			close(pin->value_fd);
+			continue;
+		}
+
+		++t->npins;
+	}
+
+	free(gpios);
+	return t->npins;
+}
+
+/* Rebuilds the table if the set of exported pins is not the one it holds. */
+int gpio_table_refresh(struct gpio_table *t)
+{
+	int *gpios;
+	int i, n;
+	bool same;
+
+	assert(t);
+
+	if (t->last_scan && now_ms() - t->last_scan < GPIO_RESCAN_INTERVAL)
+		return t->npins;
+
+	n = list_exported(&gpios);
+	if (n < 0)
+		return -1;
+
+	same = n == t->npins;
+	for (i = 0; same && i < n; ++i)
+		same = gpios[i] == t->pins[i].gpio;
+	free(gpios);
+
+	if (!same)
+		return gpio_table_rescan(t);
+
+	t->last_scan = now_ms();
+	return t->npins;
+}
+
+static struct gpio_pin *find_pin(struct gpio_table *t, int gpio)
+{
+	int lo = 0, hi = t->npins - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (t->pins[mid].gpio == gpio)
+			return &t->pins[mid];
+		if (t->pins[mid].gpio < gpio)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return NULL;
+}
+
+/* An unknown pin may just have been exported, so it triggers a rescan. */
+struct gpio_pin *gpio_table_find(struct gpio_table *t, int gpio)
+{
+	struct gpio_pin *pin;
+
+	assert(t);
+
+	pin = find_pin(t, gpio);
+	if (pin == NULL && gpio_table_rescan(t) >= 0)
+		pin = find_pin(t, gpio);
+
+	return pin;
+}
+
+int gpio_read_value(struct gpio_pin *pin)
+{
+	char buf[4];
+
+	assert(pin);
+
+	if (pread(pin->value_fd, buf, sizeof(buf), 0) < 1)
+		return -1;
+
+	return buf[0] == '1';
+}
+
+int gpio_read_direction(struct gpio_pin *pin, char *direction, size_t size)
+{
+	ssize_t len;
+
+	assert(pin && size > 0);
+
+	len = pread(pin->direction_fd, direction, size - 1, 0);
+	if (len < 1)
+		return -1;
+
+	direction[len] = '\0';
+	direction[strcspn(direction, "\n")] = '\0';
+	return 0;
+}
+
+int gpio_write_value(struct gpio_pin *pin, int value)
+{
+	assert(pin);
+
+	if (pwrite(pin->value_fd, value ? "1" : "0", 1, 0) != 1)
+		return -1;
+
+	return 0;
+}
+
+int gpio_write_direction(struct gpio_pin *pin, const char *direction)
+{
+	size_t len;
+
+	assert(pin && direction);
+
+	len = strlen(direction);
+	if (pwrite(pin->direction_fd, direction, len, 0) != (ssize_t) len)
+		return -1;
+
+	return 0;
+}
+
+static int write_edge(int gpio, const char *edge)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, PATH_MAX, "%s/gpio%d/edge", sysfs_root, gpio);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = write(fd, edge, strlen(edge));
+	close(fd);
+
+	return len == (ssize_t) strlen(edge) ? 0 : -1;
+}
+
+int gpio_watch_open(struct gpio_watch *w, int gpio, const char *edge)
+{
+	char path[PATH_MAX];
+
+	assert(w && edge);
+
+	if (write_edge(gpio, edge) < 0)
+		return -1;
+
+	snprintf(path, PATH_MAX, "%s/gpio%d/value", sysfs_root, gpio);
+	w->gpio = gpio;
+	w->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (w->fd < 0)
+		return -1;
+
+	/* sysfs only blocks in poll() once the current value has been read */
+	gpio_watch_read(w);
+
+	return 0;
+}
+
+void gpio_watch_close(struct gpio_watch *w)
+{
+	assert(w);
+
+	if (w->fd < 0)
+		return;
+
+	close(w->fd);
+	w->fd = -1;
+	write_edge(w->gpio, "none");
+}
+
+int gpio_watch_read(struct gpio_watch *w)
+{
+	char buf[64];
+	ssize_t len;
+
+	assert(w);
+
+	len = pread(w->fd, buf, sizeof(buf), 0);
+	if (len < 1)
+		return -1;
+
+	return buf[0] == '1';
+}
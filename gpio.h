@@ -0,0 +1,56 @@
+#ifndef __GPIO_H
+#define __GPIO_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Handle table of the exported sysfs GPIOs. The 'value' and 'direction'
+ * files of every pin stay open and are accessed with pread()/pwrite() at
+ * offset 0, so a pin access costs a single syscall. The table is rebuilt
+ * only when the set of exported pins changes: on a failed access, on a
+ * lookup of an unknown pin, or when a periodic listing of /sys/class/gpio
+ * (at most every GPIO_RESCAN_INTERVAL ms) differs from it.
+ */
+
+#define GPIO_RESCAN_INTERVAL 5000
+
+struct gpio_pin {
+	int gpio;
+	int value_fd;
+	int direction_fd;
+};
+
+struct gpio_table {
+	struct gpio_pin *pins;		/* sorted by gpio */
+	int npins;
+	int64_t last_scan;		/* monotonic ms */
+};
+
+struct gpio_table *gpio_table_new(void);
+void gpio_table_free(struct gpio_table *t);
+int gpio_table_rescan(struct gpio_table *t);
+int gpio_table_refresh(struct gpio_table *t);
+struct gpio_pin *gpio_table_find(struct gpio_table *t, int gpio);
+
+int gpio_read_value(struct gpio_pin *pin);
+int gpio_read_direction(struct gpio_pin *pin, char *direction, size_t size);
+int gpio_write_value(struct gpio_pin *pin, int value);
+int gpio_write_direction(struct gpio_pin *pin, const char *direction);
+
+/*
+ * Edge watches. gpio_watch_open() configures 'edge' of the pin and opens a
+ * dedicated 'value' descriptor to be polled for POLLPRI. gpio_watch_read()
+ * consumes the event and returns the current value.
+ */
+struct gpio_watch {
+	int gpio;
+	int fd;
+};
+
+void gpio_set_sysfs_root(const char *root);
+int gpio_watch_open(struct gpio_watch *w, int gpio, const char *edge);
+void gpio_watch_close(struct gpio_watch *w);
+int gpio_watch_read(struct gpio_watch *w);
+
+#endif /* __GPIO_H */
@@ -0,0 +1,360 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "irseq.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IR_MACROS_GROUP "macros"
+
+struct ir_macros {
+  GMutex lock;
+  gchar *path;
+  GKeyFile *file;
+};
+
+
+/*
+ * ir_name_valid()
+ *
+ * Remote and code names end up in lircd commands as they are.
+ */
+static gboolean
+ir_name_valid (const gchar *name, gsize max)
+{
+  gsize len = strlen (name);
+
+  if (len == 0 || len > max)
+    return FALSE;
+
+  for (; *name; name++)
+    if (!g_ascii_isgraph (*name))
+      return FALSE;
+
+  return TRUE;
+}
+
+
+/*
+ * ir_macro_name_valid()
+ */
+static gboolean
+ir_macro_name_valid (const gchar *name)
+{
+  gsize len = strlen (name);
+
+  if (len == 0 || len > IR_MACRO_NAME_MAX)
+    return FALSE;
+
+  for (; *name; name++)
+    if (!g_ascii_isalnum (*name) && *name != '_' && *name != '-' && *name != '.')
+      return FALSE;
+
+  return TRUE;
+}
+
+
+static gint
+ir_parse_uint (const gchar *text, guint max, guint *value)
+{
+  gchar *end;
+  gulong n;
+
+  errno = 0;
+  n = strtoul (text, &end, 10);
+  if (errno || *end != '\0' || *text == '-' || n > max)
+    return -1;
+
+  *value = n;
+  return 0;
+}
+
+
+/*
+ * ir_step_parse()
+ *
+ * "<remote> <code> [<repeat> [<delay>]]", 'text' is cut up.
+ */
+static gint
+ir_step_parse (struct ir_step *step, gchar *text)
+{
+  gchar *tokens[4];
+  gchar *token, *saveptr;
+  guint n = 0;
+
+  for (token = strtok_r (text, " \t", &saveptr); token; token = strtok_r (NULL, " \t", &saveptr))
+    {
+      if (n == G_N_ELEMENTS (tokens))
+        return -1;
+      tokens[n++] = token;
+    }
+
+  if (n < 2 || !ir_name_valid (tokens[0], LIRC_NAME_MAX) || !ir_name_valid (tokens[1], LIRC_NAME_MAX))
+    return -1;
+
+  step->remote = g_strdup (tokens[0]);
+  step->code = g_strdup (tokens[1]);
+
+  if (n > 2 && ir_parse_uint (tokens[2], IR_STEP_MAX_REPEAT, &step->repeat) < 0)
+    return -1;
+  if (n > 3 && ir_parse_uint (tokens[3], IR_STEP_MAX_DELAY, &step->delay) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * ir_sequence_parse()
+ *
+ * Returns NULL if 'text' is not a valid sequence.
+ */
+struct ir_sequence *
+ir_sequence_parse (const gchar *text)
+{
+  struct ir_sequence *seq;
+  gchar **steps;
+  guint i, n;
+
+  steps = g_strsplit (text, ";", -1);
+  n = g_strv_length (steps);
+
+  /* a trailing ';' leaves an empty step */
+  if (n > 0 && *g_strstrip (steps[n - 1]) == '\0')
+    n--;
+
+  if (n == 0 || n > IR_SEQUENCE_MAX_STEPS)
+    {
+      g_strfreev (steps);
+      return NULL;
+    }
+
+  seq = g_new0 (struct ir_sequence, 1);
+  seq->steps = g_new0 (struct ir_step, n);
+  seq->n = n;
+
+  for (i = 0; i < n; i++)
+    if (ir_step_parse (&seq->steps[i], steps[i]) < 0)
+      {
+        g_strfreev (steps);
+        ir_sequence_free (seq);
+        return NULL;
+      }
+
+  g_strfreev (steps);
+  return seq;
+}
+
+
+/*
+ * ir_sequence_free()
+ */
+void
+ir_sequence_free (struct ir_sequence *seq)
+{
+  guint i;
+
+  if (seq == NULL)
+    return;
+
+  for (i = 0; i < seq->n; i++)
+    {
+      g_free (seq->steps[i].remote);
+      g_free (seq->steps[i].code);
+    }
+
+  g_free (seq->steps);
+  g_free (seq);
+}
+
+
+/*
+ * ir_step_send()
+ *
+ * Sends one step and sets its status. Blocks until lircd has answered.
+ */
+gint
+ir_step_send (struct ir_step *step, struct lirc_client *lirc)
+{
+  if (lirc_send (lirc, LIRC_SEND_ONCE, step->remote, step->code, step->repeat,
+                 step->error, sizeof (step->error)) < 0)
+    {
+      step->status = IR_STEP_FAILED;
+      return -1;
+    }
+
+  step->status = IR_STEP_SENT;
+  return 0;
+}
+
+
+/*
+ * ir_macros_load()
+ *
+ * A missing file is an empty set of macros.
+ */
+struct ir_macros *
+ir_macros_load (const gchar *path)
+{
+  struct ir_macros *macros;
+
+  macros = g_new0 (struct ir_macros, 1);
+  g_mutex_init (&macros->lock);
+  macros->path = g_strdup (path);
+  macros->file = g_key_file_new ();
+
+  if (g_file_test (path, G_FILE_TEST_EXISTS) &&
+      !g_key_file_load_from_file (macros->file, path, G_KEY_FILE_KEEP_COMMENTS, NULL))
+    {
+      ir_macros_free (macros);
+      return NULL;
+    }
+
+  return macros;
+}
+
+
+/*
+ * ir_macros_free()
+ */
+void
+ir_macros_free (struct ir_macros *macros)
+{
+  if (macros == NULL)
+    return;
+
+  g_key_file_free (macros->file);
+  g_mutex_clear (&macros->lock);
+  g_free (macros->path);
+  g_free (macros);
+}
+
+
+/*
+ * ir_macros_save()
+ *
+ * Called with the lock held.
+ */
+static gint
+ir_macros_save (struct ir_macros *macros)
+{
+  gchar *data, *dir;
+  gsize len;
+  gboolean ok;
+
+  dir = g_path_get_dirname (macros->path);
+  g_mkdir_with_parents (dir, 0755);
+  g_free (dir);
+
+  /* written to a temporary file and renamed, never left half written */
+  data = g_key_file_to_data (macros->file, &len, NULL);
+  ok = g_file_set_contents (macros->path, data, len, NULL);
+  g_free (data);
+
+  return ok ? 0 : -1;
+}
+
+
+/*
+ * ir_macros_lookup()
+ *
+ * Returns a copy of the sequence of macro 'name' or NULL.
+ */
+gchar *
+ir_macros_lookup (struct ir_macros *macros, const gchar *name)
+{
+  gchar *text;
+
+  g_mutex_lock (&macros->lock);
+  text = g_key_file_get_string (macros->file, IR_MACROS_GROUP, name, NULL);
+  g_mutex_unlock (&macros->lock);
+
+  return text;
+}
+
+
+/*
+ * ir_macros_list()
+ *
+ * Returns the NULL terminated names of all macros.
+ */
+gchar **
+ir_macros_list (struct ir_macros *macros)
+{
+  gchar **names;
+
+  g_mutex_lock (&macros->lock);
+  names = g_key_file_get_keys (macros->file, IR_MACROS_GROUP, NULL, NULL);
+  g_mutex_unlock (&macros->lock);
+
+  return names ? names : g_new0 (gchar *, 1);
+}
+
+
+/*
+ * ir_macros_define()
+ *
+ * Adds or replaces a macro and saves the file. Fails with EINVAL if the
+ * name or the sequence is not valid.
+ */
+gint
+ir_macros_define (struct ir_macros *macros, const gchar *name, const gchar *text)
+{
+  struct ir_sequence *seq;
+  gint ret;
+
+  seq = ir_sequence_parse (text);
+  if (seq == NULL || !ir_macro_name_valid (name))
+    {
+      ir_sequence_free (seq);
+      errno = EINVAL;
+      return -1;
+    }
+  ir_sequence_free (seq);
+
+  g_mutex_lock (&macros->lock);
+  g_key_file_set_string (macros->file, IR_MACROS_GROUP, name, text);
+  ret = ir_macros_save (macros);
+  g_mutex_unlock (&macros->lock);
+
+  return ret;
+}
+
+
+/*
+ * ir_macros_delete()
+ *
+ * Fails with ENOENT if there is no such macro.
+ */
+gint
+ir_macros_delete (struct ir_macros *macros, const gchar *name)
+{
+  gint ret = -1;
+
+  g_mutex_lock (&macros->lock);
+  if (g_key_file_remove_key (macros->file, IR_MACROS_GROUP, name, NULL))
+    ret = ir_macros_save (macros);
+  else
+    errno = ENOENT;
+  g_mutex_unlock (&macros->lock);
+
+  return ret;
+}
@@ -0,0 +1,81 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __IRSEQ_H
+#define __IRSEQ_H
+
+#include <glib.h>
+#include "lirc.h"
+
+/*
+ * IR sequences - a few codes sent in a row, as in "power on the TV, wait
+ * for it, select the input, turn the volume up". A sequence is written as
+ * steps separated by ';':
+ *
+ *   <remote> <code> [<repeat> [<delay>]]; <remote> <code> ...
+ *
+ * 'repeat' is passed to SEND_ONCE, 'delay' is the time in ms from the
+ * start of the step to the start of the next one. The caller schedules the
+ * steps on absolute deadlines, so the time lircd spends sending a code
+ * doesn't add up along the sequence, and sends them one at a time with
+ * ir_step_send() - nothing waits out the delays in a thread.
+ *
+ * Macros are named sequences kept in a key file.
+ */
+
+#define IR_SEQUENCE_MAX_STEPS 64
+#define IR_STEP_MAX_REPEAT 50
+#define IR_STEP_MAX_DELAY 30000               /* ms */
+#define IR_MACRO_NAME_MAX 64
+#define IR_MACROS_DEFAULT_PATH "/var/lib/raspberry-control/ir-macros"
+
+enum ir_step_status {
+  IR_STEP_SKIPPED,                            /* not reached */
+  IR_STEP_SENT,
+  IR_STEP_FAILED,
+};
+
+struct ir_step {
+  gchar *remote;
+  gchar *code;
+  guint repeat;
+  guint delay;                                /* ms */
+  enum ir_step_status status;
+  gchar error[128];                           /* IR_STEP_FAILED */
+};
+
+struct ir_sequence {
+  guint n;
+  struct ir_step *steps;
+};
+
+struct ir_sequence *ir_sequence_parse (const gchar *text);
+void ir_sequence_free (struct ir_sequence *seq);
+gint ir_step_send (struct ir_step *step, struct lirc_client *lirc);
+
+struct ir_macros;
+
+struct ir_macros *ir_macros_load (const gchar *path);
+void ir_macros_free (struct ir_macros *macros);
+gchar *ir_macros_lookup (struct ir_macros *macros, const gchar *name);
+gchar **ir_macros_list (struct ir_macros *macros);
+gint ir_macros_define (struct ir_macros *macros, const gchar *name, const gchar *text);
+gint ir_macros_delete (struct ir_macros *macros, const gchar *name);
+
+#endif /* __IRSEQ_H */
@@ -0,0 +1,493 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "jsonw.h"
+#include "cbor.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define jsonw_cbor(w) ((w)->b->encoding == MSGBUF_CBOR)
+
+
+static void
+jsonw_append (struct jsonw *w, const void *data, size_t len)
+{
+  if (!w->failed && msgbuf_append (w->b, data, len) < 0)
+    w->failed = 1;
+}
+
+
+static void
+jsonw_append_byte (struct jsonw *w, unsigned char c)
+{
+  jsonw_append (w, &c, 1);
+}
+
+
+/*
+ * jsonw_value()
+ *
+ * Puts the separator in front of a value, if it needs one. Returns 0 if
+ * the writer has failed already.
+ */
+static int
+jsonw_value (struct jsonw *w)
+{
+  if (w->comma && !jsonw_cbor (w))
+    jsonw_append_byte (w, ',');
+  w->comma = 1;
+  return !w->failed;
+}
+
+
+/*
+ * utf8_sequence()
+ *
+ * Returns the length of the UTF-8 sequence at 's', 0 if there is none.
+ */
+static size_t
+utf8_sequence (const unsigned char *s, size_t left)
+{
+  uint32_t cp;
+  size_t len, i;
+
+  if (s[0] < 0x80)
+    return 1;
+  else if ((s[0] & 0xe0) == 0xc0)
+    len = 2, cp = s[0] & 0x1f;
+  else if ((s[0] & 0xf0) == 0xe0)
+    len = 3, cp = s[0] & 0x0f;
+  else if ((s[0] & 0xf8) == 0xf0)
+    len = 4, cp = s[0] & 0x07;
+  else
+    return 0;
+
+  if (len > left)
+    return 0;
+
+  for (i = 1; i < len; i++)
+    {
+      if ((s[i] & 0xc0) != 0x80)
+        return 0;
+      cp = cp << 6 | (s[i] & 0x3f);
+    }
+
+  /* overlong forms, surrogates and beyond Unicode */
+  if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000) ||
+      (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+    return 0;
+
+  return len;
+}
+
+
+/*
+ * jsonw_text()
+ *
+ * Writes 's' as a JSON string, escaped the way jansson does it. Bytes
+ * which are not UTF-8 - process names can have anything - become U+FFFD.
+ */
+static void
+jsonw_text (struct jsonw *w, const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *) s;
+  const unsigned char *run = p;
+  size_t left = strlen (s), n;
+  char esc[6];
+
+  jsonw_append_byte (w, '"');
+
+  while (left > 0)
+    {
+      n = utf8_sequence (p, left);
+      if (n > 0 && *p >= 0x20 && *p != '"' && *p != '\\')
+        {
+          p += n;
+          left -= n;
+          continue;
+        }
+
+      /* everything up to here goes out as it is */
+      jsonw_append (w, run, p - run);
+
+      if (n == 0)
+        jsonw_append (w, "\xef\xbf\xbd", 3);
+      else
+        {
+          esc[0] = '\\';
+          switch (*p)
+            {
+            case '"':  esc[1] = '"'; n = 2; break;
+            case '\\': esc[1] = '\\'; n = 2; break;
+            case '\b': esc[1] = 'b'; n = 2; break;
+            case '\f': esc[1] = 'f'; n = 2; break;
+            case '\n': esc[1] = 'n'; n = 2; break;
+            case '\r': esc[1] = 'r'; n = 2; break;
+            case '\t': esc[1] = 't'; n = 2; break;
+            default:
+              memcpy (esc + 1, "u00", 3);
+              esc[4] = hex[*p >> 4];
+              esc[5] = hex[*p & 0xf];
+              n = 6;
+              break;
+            }
+          jsonw_append (w, esc, n);
+        }
+
+      p++;
+      left--;
+      run = p;
+    }
+
+  jsonw_append (w, run, p - run);
+  jsonw_append_byte (w, '"');
+}
+
+
+/*
+ * jsonw_cbor_text()
+ *
+ * Same replacement of what is not UTF-8 as in jsonw_text(), the copy is
+ * only made for strings which need it.
+ */
+static void
+jsonw_cbor_text (struct jsonw *w, const char *s)
+{
+  const unsigned char *p = (const unsigned char *) s;
+  size_t len = strlen (s), i, n;
+  char *copy, *q;
+
+  for (i = 0; i < len; i += n)
+    if ((n = utf8_sequence (p + i, len - i)) == 0)
+      break;
+
+  if (i == len)
+    {
+      if (cbor_append_text (w->b, s, len) < 0)
+        w->failed = 1;
+      return;
+    }
+
+  /* at worst every byte becomes three */
+  copy = q = malloc (len * 3);
+  if (copy == NULL)
+    {
+      w->failed = 1;
+      return;
+    }
+
+  for (i = 0; i < len; i += n)
+    {
+      n = utf8_sequence (p + i, len - i);
+      if (n == 0)
+        {
+          memcpy (q, "\xef\xbf\xbd", 3);
+          q += 3;
+          n = 1;
+        }
+      else
+        {
+          memcpy (q, p + i, n);
+          q += n;
+        }
+    }
+
+  if (cbor_append_text (w->b, copy, q - copy) < 0)
+    w->failed = 1;
+  free (copy);
+}
+
+
+/*
+ * jsonw_init()
+ */
+void
+jsonw_init (struct jsonw *w, struct msgbuf *b)
+{
+  w->b = b;
+  w->start = b->len;
+  w->comma = 0;
+  w->failed = 0;
+}
+
+
+/*
+ * jsonw_finish()
+ *
+ * Returns the number of bytes written or -1 - in which case the payload
+ * is left as it was before jsonw_init().
+ */
+int
+jsonw_finish (struct jsonw *w)
+{
+  if (w->failed)
+    {
+      w->b->len = w->start;
+      return -1;
+    }
+
+  return w->b->len - w->start;
+}
+
+
+/*
+ * jsonw_object_begin()
+ */
+void
+jsonw_object_begin (struct jsonw *w)
+{
+  if (jsonw_value (w))
+    jsonw_append_byte (w, jsonw_cbor (w) ? CBOR_MAP_BEGIN : '{');
+  w->comma = 0;
+}
+
+
+/*
+ * jsonw_object_end()
+ */
+void
+jsonw_object_end (struct jsonw *w)
+{
+  jsonw_append_byte (w, jsonw_cbor (w) ? CBOR_BREAK : '}');
+  w->comma = 1;
+}
+
+
+/*
+ * jsonw_array_begin()
+ */
+void
+jsonw_array_begin (struct jsonw *w)
+{
+  if (jsonw_value (w))
+    jsonw_append_byte (w, jsonw_cbor (w) ? CBOR_ARRAY_BEGIN : '[');
+  w->comma = 0;
+}
+
+
+/*
+ * jsonw_array_end()
+ */
+void
+jsonw_array_end (struct jsonw *w)
+{
+  jsonw_append_byte (w, jsonw_cbor (w) ? CBOR_BREAK : ']');
+  w->comma = 1;
+}
+
+
+/*
+ * jsonw_key()
+ *
+ * The value written next is the one of 'key'.
+ */
+void
+jsonw_key (struct jsonw *w, const char *key)
+{
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    {
+      if (cbor_append_key (w->b, key) < 0)
+        w->failed = 1;
+    }
+  else
+    {
+      jsonw_text (w, key);
+      jsonw_append_byte (w, ':');
+    }
+
+  w->comma = 0;
+}
+
+
+/*
+ * jsonw_string()
+ *
+ * A NULL 'value' is written as null.
+ */
+void
+jsonw_string (struct jsonw *w, const char *value)
+{
+  if (value == NULL)
+    {
+      jsonw_null (w);
+      return;
+    }
+
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    jsonw_cbor_text (w, value);
+  else
+    jsonw_text (w, value);
+}
+
+
+/*
+ * jsonw_int()
+ */
+void
+jsonw_int (struct jsonw *w, int64_t value)
+{
+  char buf[24], *p = buf + sizeof (buf);
+  uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    {
+      if (cbor_append_int (w->b, value) < 0)
+        w->failed = 1;
+      return;
+    }
+
+  do
+    *--p = '0' + v % 10;
+  while ((v /= 10) > 0);
+
+  if (value < 0)
+    *--p = '-';
+
+  jsonw_append (w, p, buf + sizeof (buf) - p);
+}
+
+
+/*
+ * jsonw_real_format()
+ *
+ * "%.<digits>g" with a ".0" for integral values and no '+' or leading
+ * zeros in the exponent, as jansson prints them. There is no JSON for NaN
+ * and the infinities, they are written as null.
+ */
+static void
+jsonw_real_format (struct jsonw *w, double value, int digits)
+{
+  char buf[32], *p, *exp;
+  int len;
+
+  if (!isfinite (value))
+    {
+      jsonw_null (w);
+      return;
+    }
+
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    {
+      /* a single precision float holds 6 digits */
+      if (cbor_append_real (w->b, digits <= 6 ? (float) value : value) < 0)
+        w->failed = 1;
+      return;
+    }
+
+  len = snprintf (buf, sizeof (buf), "%.*g", digits, value);
+
+  /* the decimal point of the locale */
+  for (p = buf; *p; p++)
+    if (*p == ',')
+      *p = '.';
+
+  exp = strchr (buf, 'e');
+  if (exp == NULL && strchr (buf, '.') == NULL)
+    {
+      memcpy (buf + len, ".0", 3);
+      len += 2;
+    }
+  else if (exp != NULL)
+    {
+      p = exp + 1;
+      if (*p == '-')
+        p++;
+      exp = p;
+      if (*p == '+')
+        p++;
+      while (*p == '0' && p[1] != '\0')
+        p++;
+      memmove (exp, p, strlen (p) + 1);
+      len = strlen (buf);
+    }
+
+  jsonw_append (w, buf, len);
+}
+
+
+/*
+ * jsonw_real()
+ */
+void
+jsonw_real (struct jsonw *w, double value)
+{
+  jsonw_real_format (w, value, 17);
+}
+
+
+/*
+ * jsonw_real_digits()
+ *
+ * Only 'digits' significant digits, for values which have no more.
+ */
+void
+jsonw_real_digits (struct jsonw *w, double value, int digits)
+{
+  jsonw_real_format (w, value, digits);
+}
+
+
+/*
+ * jsonw_bool()
+ */
+void
+jsonw_bool (struct jsonw *w, int value)
+{
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    jsonw_append_byte (w, value ? CBOR_TRUE : CBOR_FALSE);
+  else if (value)
+    jsonw_append (w, "true", 4);
+  else
+    jsonw_append (w, "false", 5);
+}
+
+
+/*
+ * jsonw_null()
+ */
+void
+jsonw_null (struct jsonw *w)
+{
+  if (!jsonw_value (w))
+    return;
+
+  if (jsonw_cbor (w))
+    jsonw_append_byte (w, CBOR_NULL);
+  else
+    jsonw_append (w, "null", 4);
+}
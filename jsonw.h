@@ -0,0 +1,64 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __JSONW_H
+#define __JSONW_H
+
+#include <stdint.h>
+#include "msgbuf.h"
+
+/*
+ * Streaming writer for responses - serializes straight into the payload of
+ * an outbound message, with no tree in between. The output is the same
+ * JSON text jansson would print, or CBOR on a binary session, where
+ * objects and arrays are of indefinite length.
+ *
+ *   jsonw_init (&w, out);
+ *   jsonw_object_begin (&w);
+ *   jsonw_key (&w, "Revision");
+ *   jsonw_string (&w, "0002");
+ *   jsonw_object_end (&w);
+ *   len = jsonw_finish (&w);
+ *
+ * Errors stick until jsonw_finish(), calls made meanwhile do nothing.
+ */
+struct jsonw {
+  struct msgbuf *b;
+  size_t start;                 /* b->len at jsonw_init() */
+  int comma;                    /* the next value needs a separator */
+  int failed;
+};
+
+void jsonw_init (struct jsonw *w, struct msgbuf *b);
+int jsonw_finish (struct jsonw *w);
+
+void jsonw_object_begin (struct jsonw *w);
+void jsonw_object_end (struct jsonw *w);
+void jsonw_array_begin (struct jsonw *w);
+void jsonw_array_end (struct jsonw *w);
+void jsonw_key (struct jsonw *w, const char *key);
+
+void jsonw_string (struct jsonw *w, const char *value);
+void jsonw_int (struct jsonw *w, int64_t value);
+void jsonw_real (struct jsonw *w, double value);
+void jsonw_real_digits (struct jsonw *w, double value, int digits);
+void jsonw_bool (struct jsonw *w, int value);
+void jsonw_null (struct jsonw *w);
+
+#endif /* __JSONW_H */
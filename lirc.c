@@ -0,0 +1,314 @@
+#include "lirc.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#define LIRC_LINE_MAX	256
+
+struct lirc_client {
+	pthread_mutex_t lock;
+	char *path;
+	int fd;				/* -1 when not connected */
+	size_t len;			/* bytes in buf */
+	char buf[1024];			/* received, not parsed yet */
+};
+
+static const char *const directives[] = {
+	[LIRC_SEND_ONCE] = "SEND_ONCE",
+	[LIRC_SEND_START] = "SEND_START",
+	[LIRC_SEND_STOP] = "SEND_STOP",
+};
+
+static void lirc_disconnect(struct lirc_client *c)
+{
+	int err = errno;
+
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+	errno = err;
+}
+
+static int lirc_connect(struct lirc_client *c)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { LIRC_TIMEOUT, 0 };
+
+	if (strlen(c->path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, c->path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		return -1;
+
+	if (setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+	    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0 ||
+	    connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		lirc_disconnect(c);
+		return -1;
+	}
+
+	c->len = 0;
+	return 0;
+}
+
+static int lirc_write(struct lirc_client *c, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		/* no SIGPIPE if lircd is gone, just EPIPE */
+		n = send(c->fd, data, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * An idle connection lircd has closed reads as EOF. Found before a command
+ * goes out on it, the command can go out on a new one instead.
+ */
+static int lirc_stale(struct lirc_client *c)
+{
+	char byte;
+	ssize_t n;
+
+	n = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/* Reads one line without its '\n' - truncated to fit 'size' - or returns -1. */
+static int lirc_read_line(struct lirc_client *c, char *line, size_t size)
+{
+	char *nl;
+	size_t len;
+	ssize_t n;
+
+	while ((nl = memchr(c->buf, '\n', c->len)) == NULL) {
+		if (c->len == sizeof(c->buf)) {
+			errno = EPROTO;
+			return -1;
+		}
+		n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			errno = ECONNRESET;
+		if (n <= 0)
+			return -1;
+		c->len += n;
+	}
+
+	len = nl - c->buf;
+	snprintf(line, size, "%.*s", (int) len, c->buf);
+	c->len -= len + 1;
+	memmove(c->buf, nl + 1, c->len);
+
+	return 0;
+}
+
+/*
+ * Waits for the reply to 'command':
+ *
+ *	BEGIN
+ *	<command>
+ *	SUCCESS or ERROR
+ *	DATA		(optional)
+ *	<n>
+ *	<n lines>
+ *	END
+ *
+ * Returns 0 on SUCCESS, 1 on ERROR with the first data line in 'err' and
+ * -1 if the connection failed or lircd made no sense.
+ */
+static int lirc_read_reply(struct lirc_client *c, const char *command, char *err, size_t errlen)
+{
+	char line[LIRC_LINE_MAX];
+	unsigned long i, n;
+	int ret;
+
+	for (;;) {
+		do {
+			if (lirc_read_line(c, line, sizeof(line)) < 0)
+				return -1;
+		} while (strcmp(line, "BEGIN") != 0);
+
+		if (lirc_read_line(c, line, sizeof(line)) < 0)
+			return -1;
+		if (strcmp(line, command) == 0)
+			break;
+
+		/* someone else's - a SIGHUP notice */
+		do {
+			if (lirc_read_line(c, line, sizeof(line)) < 0)
+				return -1;
+		} while (strcmp(line, "END") != 0);
+	}
+
+	if (lirc_read_line(c, line, sizeof(line)) < 0)
+		return -1;
+	if (strcmp(line, "SUCCESS") == 0)
+		ret = 0;
+	else if (strcmp(line, "ERROR") == 0)
+		ret = 1;
+	else
+		goto bad_reply;
+
+	snprintf(err, errlen, "lircd refused the command");
+
+	if (lirc_read_line(c, line, sizeof(line)) < 0)
+		return -1;
+	if (strcmp(line, "DATA") == 0) {
+		if (lirc_read_line(c, line, sizeof(line)) < 0)
+			return -1;
+		n = strtoul(line, NULL, 10);
+		for (i = 0; i < n; ++i) {
+			if (lirc_read_line(c, line, sizeof(line)) < 0)
+				return -1;
+			if (i == 0 && ret == 1)
+				snprintf(err, errlen, "%s", line);
+		}
+		if (lirc_read_line(c, line, sizeof(line)) < 0)
+			return -1;
+	}
+	if (strcmp(line, "END") != 0)
+		goto bad_reply;
+
+	return ret;
+bad_reply:
+	errno = EPROTO;
+	return -1;
+}
+
+/* Remote and code names go on the command line as they are. */
+static int valid_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len == 0 || len > LIRC_NAME_MAX)
+		return 0;
+
+	for (; *name; ++name)
+		if (!isgraph((unsigned char) *name))
+			return 0;
+
+	return 1;
+}
+
+struct lirc_client *lirc_client_new(const char *path)
+{
+	struct lirc_client *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	c->path = strdup(path);
+	if (c->path == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	c->fd = -1;
+	return c;
+}
+
+void lirc_client_free(struct lirc_client *c)
+{
+	if (c == NULL)
+		return;
+
+	lirc_disconnect(c);
+	pthread_mutex_destroy(&c->lock);
+	free(c->path);
+	free(c);
+}
+
+/*
+ * Returns 0 once lircd has sent the code, -1 with the reason in 'err'
+ * otherwise. 'repeat' asks SEND_ONCE for that many repeats of the code.
+ */
+int lirc_send(struct lirc_client *c, enum lirc_directive directive, const char *remote,
+		const char *code, unsigned int repeat, char *err, size_t errlen)
+{
+	char command[LIRC_LINE_MAX];
+	int attempt, saved, ret = -1;
+	size_t len;
+
+	assert(c && directive <= LIRC_SEND_STOP);
+
+	if (!valid_name(remote) || !valid_name(code)) {
+		snprintf(err, errlen, "invalid remote or code name");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (directive == LIRC_SEND_ONCE && repeat > 0)
+		len = snprintf(command, sizeof(command), "%s %s %s %u\n", directives[directive],
+				remote, code, repeat);
+	else
+		len = snprintf(command, sizeof(command), "%s %s %s\n", directives[directive], remote, code);
+
+	pthread_mutex_lock(&c->lock);
+
+	for (attempt = 0; attempt < 2; ++attempt) {
+		if (c->fd >= 0 && lirc_stale(c))
+			lirc_disconnect(c);
+
+		if (c->fd < 0 && lirc_connect(c) < 0) {
+			snprintf(err, errlen, "can't connect to %s: %s", c->path, strerror(errno));
+			break;
+		}
+
+		if (lirc_write(c, command, len) < 0) {
+			saved = errno;
+			snprintf(err, errlen, "lircd connection failed: %s", strerror(saved));
+			lirc_disconnect(c);
+
+			/* without its '\n' lircd ran nothing, a new connection may do */
+			if (saved == EPIPE || saved == ECONNRESET || saved == ENOTCONN)
+				continue;
+			break;
+		}
+
+		/*
+		 * The code may be on the air already - whatever happens to the
+		 * reply, it is not sent again: a second KEY_POWER undoes the first.
+		 * The reply echoes the command without its '\n'.
+		 */
+		command[len - 1] = '\0';
+		ret = lirc_read_reply(c, command, err, errlen);
+		if (ret < 0) {
+			snprintf(err, errlen, "lircd connection failed: %s", strerror(errno));
+			lirc_disconnect(c);
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return ret == 0 ? 0 : -1;
+}
@@ -0,0 +1,31 @@
+#ifndef __LIRC_H
+#define __LIRC_H
+#include <stddef.h>
+
+/*
+ * Client of the lircd UNIX socket. Commands are written in the LIRC text
+ * protocol over one persistent connection, which is opened on first use
+ * and reopened whenever lircd has gone away. Replies are parsed for
+ * SUCCESS / ERROR; broadcasts lircd sends to every client (decoded IR
+ * codes, SIGHUP notices) are skipped. Commands from several threads are
+ * serialized.
+ */
+
+#define LIRC_DEFAULT_SOCKET	"/var/run/lirc/lircd"
+#define LIRC_TIMEOUT		5	/* seconds to wait for lircd */
+#define LIRC_NAME_MAX		64	/* remote and code names */
+
+enum lirc_directive {
+	LIRC_SEND_ONCE,
+	LIRC_SEND_START,
+	LIRC_SEND_STOP,
+};
+
+struct lirc_client;
+
+struct lirc_client *lirc_client_new(const char *path);
+void lirc_client_free(struct lirc_client *c);
+int lirc_send(struct lirc_client *c, enum lirc_directive directive, const char *remote,
+		const char *code, unsigned int repeat, char *err, size_t errlen);
+
+#endif /* __LIRC_H */
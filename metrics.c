@@ -0,0 +1,141 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "metrics.h"
+
+#include <inttypes.h>
+
+/* buckets above ~134s are only counted in +Inf */
+#define HISTOGRAM_EXPORT_MAX (26 * HISTOGRAM_SUB)
+
+
+/*
+ * histogram_index()
+ */
+static unsigned int
+histogram_index (uint64_t us)
+{
+  unsigned int exp;
+
+  if (us > UINT32_MAX)
+    us = UINT32_MAX;
+  if (us < HISTOGRAM_SUB)
+    return us;
+
+  exp = 31 - __builtin_clz ((uint32_t) us);
+  return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+         ((us >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+
+/*
+ * histogram_upper()
+ *
+ * First value past bucket 'i'.
+ */
+static uint64_t
+histogram_upper (unsigned int i)
+{
+  unsigned int shift;
+
+  if (i < HISTOGRAM_SUB)
+    return i + 1;
+
+  shift = i / HISTOGRAM_SUB - 1;
+  return ((uint64_t) (HISTOGRAM_SUB + i % HISTOGRAM_SUB) << shift) + ((uint64_t) 1 << shift);
+}
+
+
+/*
+ * histogram_record()
+ */
+void
+histogram_record (struct histogram *h, uint64_t us)
+{
+  metric_add (&h->buckets[histogram_index (us)], 1);
+  metric_add (&h->sum, us);
+  metric_add (&h->count, 1);
+}
+
+
+/*
+ * metrics_format_header()
+ */
+void
+metrics_format_header (GString *out, const char *name, const char *type, const char *help)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/*
+ * metrics_format_value()
+ *
+ * 'labels' is either NULL or the inside of the braces, e.g. cmd="GetGPIO".
+ */
+void
+metrics_format_value (GString *out, const char *name, const char *labels, uint64_t value)
+{
+  if (labels)
+    g_string_append_printf (out, "%s{%s} %" PRIu64 "\n", name, labels, value);
+  else
+    g_string_append_printf (out, "%s %" PRIu64 "\n", name, value);
+}
+
+
+/*
+ * metrics_format_histogram()
+ *
+ * Buckets are cumulative and always the same set, in seconds.
+ */
+void
+metrics_format_histogram (GString *out, const char *name, const char *labels,
+                          const struct histogram *h)
+{
+  const char *sep = labels ? "," : "";
+  uint64_t cumulative = 0;
+  unsigned int i;
+
+  if (labels == NULL)
+    labels = "";
+
+  for (i = 0; i < HISTOGRAM_EXPORT_MAX; i++)
+    {
+      cumulative += metric_get (&h->buckets[i]);
+      g_string_append_printf (out, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n",
+                              name, labels, sep, histogram_upper (i) / 1e6, cumulative);
+    }
+
+  /* summed from the buckets, 'count' may be a step ahead of them */
+  for (; i < HISTOGRAM_BUCKETS; i++)
+    cumulative += metric_get (&h->buckets[i]);
+
+  g_string_append_printf (out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, cumulative);
+
+  if (labels[0])
+    {
+      g_string_append_printf (out, "%s_sum{%s} %g\n", name, labels, metric_get (&h->sum) / 1e6);
+      g_string_append_printf (out, "%s_count{%s} %" PRIu64 "\n", name, labels, cumulative);
+    }
+  else
+    {
+      g_string_append_printf (out, "%s_sum %g\n", name, metric_get (&h->sum) / 1e6);
+      g_string_append_printf (out, "%s_count %" PRIu64 "\n", name, cumulative);
+    }
+}
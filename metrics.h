@@ -0,0 +1,54 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Lock-free counters and latency histograms, exported in the Prometheus
+ * text format.
+ *
+ * Histograms are log-linear (HDR style): every power of two is split in
+ * HISTOGRAM_SUB linear buckets, so any recorded value is off by at most
+ * 1/HISTOGRAM_SUB of itself. Values are microseconds.
+ */
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+#define metric_add(p, v) __atomic_fetch_add ((p), (v), __ATOMIC_RELAXED)
+#define metric_get(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+
+void histogram_record (struct histogram *h, uint64_t us);
+
+void metrics_format_header (GString *out, const char *name, const char *type, const char *help);
+void metrics_format_value (GString *out, const char *name, const char *labels, uint64_t value);
+void metrics_format_histogram (GString *out, const char *name, const char *labels,
+                               const struct histogram *h);
+
+#endif /* __METRICS_H */
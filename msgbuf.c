@@ -0,0 +1,232 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "msgbuf.h"
+#include "cbor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MSGBUF_EXTRA (LWS_SEND_BUFFER_PRE_PADDING + LWS_SEND_BUFFER_POST_PADDING)
+
+
+/*
+ * msgbuf_new()
+ *
+ * New messages are JSON, set 'encoding' before serializing anything else.
+ */
+struct msgbuf *
+msgbuf_new (size_t size)
+{
+  struct msgbuf *b;
+
+  b = calloc (1, sizeof (*b));
+  if (b == NULL)
+    return NULL;
+
+  b->data = malloc (size + MSGBUF_EXTRA);
+  if (b->data == NULL)
+    {
+      free (b);
+      return NULL;
+    }
+
+  b->size = size;
+  b->refcount = 1;
+  return b;
+}
+
+
+/*
+ * msgbuf_ref()
+ */
+struct msgbuf *
+msgbuf_ref (struct msgbuf *b)
+{
+  __atomic_add_fetch (&b->refcount, 1, __ATOMIC_RELAXED);
+  return b;
+}
+
+
+/*
+ * msgbuf_unref()
+ */
+void
+msgbuf_unref (struct msgbuf *b)
+{
+  if (b == NULL || __atomic_sub_fetch (&b->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  free (b->data);
+  free (b);
+}
+
+
+/*
+ * msgbuf_reset()
+ */
+void
+msgbuf_reset (struct msgbuf *b)
+{
+  b->len = 0;
+}
+
+
+/*
+ * msgbuf_reserve()
+ *
+ * Makes room for 'len' more payload bytes.
+ */
+int
+msgbuf_reserve (struct msgbuf *b, size_t len)
+{
+  unsigned char *data;
+  size_t size = b->size;
+
+  if (b->len + len <= size)
+    return 0;
+
+  while (size < b->len + len)
+    size = size ? size * 2 : 1024;
+
+  data = realloc (b->data, size + MSGBUF_EXTRA);
+  if (data == NULL)
+    return -1;
+
+  b->data = data;
+  b->size = size;
+  return 0;
+}
+
+
+/*
+ * msgbuf_append()
+ */
+int
+msgbuf_append (struct msgbuf *b, const void *data, size_t len)
+{
+  if (msgbuf_reserve (b, len) < 0)
+    return -1;
+
+  memcpy (msgbuf_payload (b) + b->len, data, len);
+  b->len += len;
+  return 0;
+}
+
+
+static int
+msgbuf_dump_callback (const char *buffer, size_t size, void *data)
+{
+  return msgbuf_append (data, buffer, size);
+}
+
+
+/*
+ * msgbuf_append_json()
+ *
+ * Serializes 'json' at the end of the payload in the encoding of the
+ * message, returns the number of bytes added or -1 - in which case the
+ * payload is left as it was.
+ */
+int
+msgbuf_append_json (struct msgbuf *b, const json_t *json)
+{
+  size_t len = b->len;
+  int ret;
+
+  if (json == NULL)
+    return -1;
+
+  if (b->encoding == MSGBUF_CBOR)
+    ret = cbor_append_json (b, json);
+  else
+    ret = json_dump_callback (json, msgbuf_dump_callback, b, JSON_COMPACT);
+
+  if (ret < 0)
+    {
+      b->len = len;
+      return -1;
+    }
+
+  return b->len - len;
+}
+
+
+/*
+ * msgbuf_write()
+ *
+ * Sends the payload from '*offset' on as frame fragments of at most
+ * 'fragment' bytes, for as long as the socket takes them. 'type' is
+ * LWS_WRITE_TEXT or LWS_WRITE_BINARY for a websocket message or
+ * LWS_WRITE_HTTP for a plain HTTP body. Returns 0 when the whole message is out, 1 when the rest has
+ * to wait for the next writeable callback (with '*offset' updated) and -1
+ * on error.
+ */
+int
+msgbuf_write (struct libwebsocket *wsi, struct msgbuf *b, size_t *offset, size_t fragment,
+              enum libwebsocket_write_protocol type)
+{
+  unsigned char saved [LWS_SEND_BUFFER_PRE_PADDING];
+  unsigned char saved_post [LWS_SEND_BUFFER_POST_PADDING];
+  unsigned char *p;
+  size_t chunk;
+  int flags, n;
+
+  while (*offset < b->len)
+    {
+      p = msgbuf_payload (b) + *offset;
+      chunk = b->len - *offset;
+      if (chunk > fragment)
+        chunk = fragment;
+
+      if (type == LWS_WRITE_HTTP)
+        flags = LWS_WRITE_HTTP;
+      else
+        {
+          flags = *offset == 0 ? type : LWS_WRITE_CONTINUATION;
+          if (*offset + chunk < b->len)
+            flags |= LWS_WRITE_NO_FIN;
+        }
+
+      /*
+       * the frame header goes in front of the fragment, over payload already
+       * sent, and the padding behind it is payload still to be sent
+       */
+      if (*offset > 0)
+        memcpy (saved, p - LWS_SEND_BUFFER_PRE_PADDING, sizeof (saved));
+      memcpy (saved_post, p + chunk, sizeof (saved_post));
+
+      n = libwebsocket_write (wsi, p, chunk, flags);
+
+      if (*offset > 0)
+        memcpy (p - LWS_SEND_BUFFER_PRE_PADDING, saved, sizeof (saved));
+      memcpy (p + chunk, saved_post, sizeof (saved_post));
+
+      if (n < 0)
+        return -1;
+
+      /* whatever the socket didn't take is buffered by libwebsockets */
+      *offset += chunk;
+
+      if (*offset < b->len && lws_send_pipe_choked (wsi))
+        return 1;
+    }
+
+  return 0;
+}
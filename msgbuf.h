@@ -0,0 +1,68 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __MSGBUF_H
+#define __MSGBUF_H
+
+#include <stddef.h>
+#include <jansson.h>
+#include <libwebsockets.h>
+
+/*
+ * Growable outbound message. The payload is always preceded by
+ * LWS_SEND_BUFFER_PRE_PADDING and followed by LWS_SEND_BUFFER_POST_PADDING
+ * bytes, so it can be handed to libwebsocket_write() as it is - handlers
+ * serialize straight into it and nothing is copied on the way out.
+ *
+ * Messages are reference counted, one snapshot can sit in the outbound
+ * queues of many sessions at once. Taking and dropping references is
+ * thread safe, the contents are not.
+ *
+ * A message is either JSON text or CBOR, whichever its session
+ * negotiated; msgbuf_append_json() serializes in the encoding of the
+ * message.
+ */
+enum msgbuf_encoding {
+  MSGBUF_JSON,
+  MSGBUF_CBOR,
+  MSGBUF_ENCODINGS
+};
+
+struct msgbuf {
+  unsigned char *data;
+  size_t len;                   /* payload length */
+  size_t size;                  /* payload capacity */
+  unsigned int refcount;
+  enum msgbuf_encoding encoding;
+};
+
+#define msgbuf_payload(b) ((b)->data + LWS_SEND_BUFFER_PRE_PADDING)
+
+struct msgbuf *msgbuf_new (size_t size);
+struct msgbuf *msgbuf_ref (struct msgbuf *b);
+void msgbuf_unref (struct msgbuf *b);
+void msgbuf_reset (struct msgbuf *b);
+int msgbuf_reserve (struct msgbuf *b, size_t len);
+int msgbuf_append (struct msgbuf *b, const void *data, size_t len);
+int msgbuf_append_json (struct msgbuf *b, const json_t *json);
+
+int msgbuf_write (struct libwebsocket *wsi, struct msgbuf *b, size_t *offset, size_t fragment,
+                  enum libwebsocket_write_protocol type);
+
+#endif /* __MSGBUF_H */
@@ -0,0 +1,430 @@
+#include "proctab.h"
+
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/*
+ * CPU usage is measured over at least this long. With CLK_TCK at 100 a
+ * window of a few ms holds zero or one tick, 0% or hundreds of %.
+ */
+#define CPU_WINDOW_MS		1000
+
+/* a process is reported as changed past these */
+#define CPU_THRESHOLD		1.0	/* % */
+#define MEM_THRESHOLD		64	/* kB */
+
+/*
+ * Open addressing (linear probing) table of the CPU ticks seen for each pid
+ * at the previous snapshot. Slots not touched by a snapshot belong to pids
+ * which are gone and are swept right after it; deletion shifts the rest of
+ * the cluster back, so there are no tombstones to clean up later.
+ */
+struct tick_slot {
+	pid_t pid;			/* 0 marks an empty slot */
+	unsigned int gen;
+	uint64_t starttime;		/* tells reused pids apart */
+	uint64_t ticks;			/* utime + stime at the start of the window */
+	int64_t ms;			/* CLOCK_MONOTONIC of that */
+	double cpu;			/* % over the last full window */
+};
+
+struct tick_table {
+	struct tick_slot *slots;
+	unsigned int size;		/* power of 2 */
+	unsigned int used;
+	unsigned int gen;
+};
+
+struct proc_history {
+	unsigned int seq;		/* sequence number of the last snapshot */
+	unsigned int head;		/* slot of the next snapshot */
+	struct proc_snapshot *snaps[PROC_HISTORY_MAX];
+	struct tick_table ticks;
+	long clk_tck;
+};
+
+static unsigned int pid_hash(pid_t pid, unsigned int size)
+{
+	return ((uint32_t) pid * 2654435761u) & (size - 1);
+}
+
+static struct tick_slot *tick_lookup(struct tick_table *t, pid_t pid)
+{
+	unsigned int i = pid_hash(pid, t->size);
+
+	while (t->slots[i].pid && t->slots[i].pid != pid)
+		i = (i + 1) & (t->size - 1);
+
+	return &t->slots[i];
+}
+
+static int tick_grow(struct tick_table *t)
+{
+	struct tick_slot *old = t->slots;
+	unsigned int i, size = t->size;
+
+	t->slots = calloc(size * 2, sizeof(*t->slots));
+	if (t->slots == NULL) {
+		t->slots = old;
+		return -1;
+	}
+	t->size = size * 2;
+
+	for (i = 0; i < size; ++i)
+		if (old[i].pid)
+			*tick_lookup(t, old[i].pid) = old[i];
+
+	free(old);
+	return 0;
+}
+
+/* Returns the slot of pid, creating an empty one (ticks == 0) if needed. */
+static struct tick_slot *tick_get(struct tick_table *t, pid_t pid)
+{
+	struct tick_slot *slot;
+
+	if ((t->used + 1) * 2 > t->size && tick_grow(t) < 0)
+		return NULL;
+
+	slot = tick_lookup(t, pid);
+	if (slot->pid == 0) {
+		memset(slot, 0, sizeof(*slot));
+		slot->pid = pid;
+		++t->used;
+	}
+
+	return slot;
+}
+
+static void tick_sweep(struct tick_table *t)
+{
+	unsigned int i, j, hole, home, mask = t->size - 1;
+
+	for (i = 0; i < t->size; ) {
+		if (t->slots[i].pid == 0 || t->slots[i].gen == t->gen) {
+			++i;
+			continue;
+		}
+
+		/* backward shift deletion, then look at slot i again */
+		--t->used;
+		hole = i;
+		for (j = (i + 1) & mask; t->slots[j].pid; j = (j + 1) & mask) {
+			home = pid_hash(t->slots[j].pid, t->size);
+			if (((j - home) & mask) < ((j - hole) & mask))
+				continue;
+			t->slots[hole] = t->slots[j];
+			hole = j;
+		}
+		t->slots[hole].pid = 0;
+	}
+}
+
+static void copy_field(char *dst, size_t size, const char *line, size_t skip)
+{
+	const char *p = line + skip;
+
+	while (*p != '\0' && isspace((unsigned char) *p))
+		++p;
+
+	snprintf(dst, size, "%s", p);
+	dst[strcspn(dst, "\n")] = '\0';
+}
+
+static int read_proc_status(struct proc_entry *e)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	char line[1000];
+
+	snprintf(path, PATH_MAX, "/proc/%d/status", (int) e->pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "Name:", 5) == 0)
+			copy_field(e->name, sizeof(e->name), line, 5);
+		else if (strncmp(line, "Uid:", 4) == 0)
+			e->uid = strtol(line + 4, NULL, 10);
+		else if (strncmp(line, "State:", 6) == 0)
+			copy_field(e->state, sizeof(e->state), line, 6);
+		else if (strncmp(line, "VmRSS:", 6) == 0)
+			e->rss = strtoul(line + 6, NULL, 10);
+		else if (strncmp(line, "VmSwap:", 7) == 0)
+			e->swap = strtoul(line + 7, NULL, 10);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* Reads utime + stime and starttime from /proc/<pid>/stat. */
+static int read_proc_stat(pid_t pid, uint64_t *ticks, uint64_t *starttime)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	char line[1024];
+	char *p;
+	uint64_t utime, stime;
+
+	snprintf(path, PATH_MAX, "/proc/%d/stat", (int) pid);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	p = fgets(line, sizeof(line), fp);
+	fclose(fp);
+
+	/* comm may contain spaces and parentheses, fields start after the last ')' */
+	if (p == NULL || (p = strrchr(line, ')')) == NULL)
+		return -1;
+
+	/* state(3) ... utime(14) stime(15) ... starttime(22) */
+	if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %"SCNu64" %"SCNu64
+			" %*d %*d %*d %*d %*d %*d %"SCNu64, &utime, &stime, starttime) != 3)
+		return -1;
+
+	*ticks = utime + stime;
+	return 0;
+}
+
+/*
+ * Fills e->cpu from the ticks remembered for e->pid. The window moves on
+ * once CPU_WINDOW_MS have passed, snapshots closer together than that
+ * report the usage over the last full window.
+ */
+static void account_cpu(struct proc_history *h, struct proc_entry *e, int64_t now)
+{
+	struct tick_slot *slot;
+	uint64_t ticks, starttime;
+
+	if (read_proc_stat(e->pid, &ticks, &starttime) < 0)
+		return;
+
+	slot = tick_get(&h->ticks, e->pid);
+	if (slot == NULL)
+		return;
+
+	if (slot->ms == 0 || slot->starttime != starttime || ticks < slot->ticks) {
+		/* new or reused pid */
+		slot->starttime = starttime;
+		slot->ticks = ticks;
+		slot->ms = now;
+		slot->cpu = 0;
+	} else if (now - slot->ms >= CPU_WINDOW_MS) {
+		slot->cpu = (double)(ticks - slot->ticks) * 1000.0 * 100.0 / h->clk_tck / (now - slot->ms);
+		slot->ticks = ticks;
+		slot->ms = now;
+	}
+
+	slot->gen = h->ticks.gen;
+	e->cpu = slot->cpu;
+}
+
+static unsigned long ul_diff(unsigned long a, unsigned long b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	const struct proc_entry *x = a, *y = b;
+
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static void proc_snapshot_free(struct proc_snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+	free(snap->entries);
+	free(snap);
+}
+
+static int64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct proc_snapshot *proc_snapshot_take(struct proc_history *h, int64_t now)
+{
+	struct proc_snapshot *snap;
+	struct proc_entry *e;
+	struct dirent *ent;
+	DIR *dir;
+	void *tmp;
+	int size = 0;
+
+	dir = opendir("/proc");
+	if (dir == NULL)
+		return NULL;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		goto fail;
+
+	snap->ms = now;
+	++h->ticks.gen;
+
+	for (ent = readdir(dir); ent; ent = readdir(dir)) {
+		if (ent->d_type != DT_DIR || !isdigit((unsigned char) ent->d_name[0]))
+			continue;
+
+		if (snap->n == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(snap->entries, size * sizeof(*snap->entries));
+			if (tmp == NULL)
+				goto fail;
+			snap->entries = tmp;
+		}
+
+		e = &snap->entries[snap->n];
+		memset(e, 0, sizeof(*e));
+		e->pid = atoi(ent->d_name);
+
+		/* the process may be gone by now */
+		if (read_proc_status(e) < 0)
+			continue;
+		account_cpu(h, e, now);
+		++snap->n;
+	}
+
+	closedir(dir);
+	tick_sweep(&h->ticks);
+	qsort(snap->entries, snap->n, sizeof(*snap->entries), cmp_pid);
+	return snap;
+fail:
+	closedir(dir);
+	proc_snapshot_free(snap);
+	return NULL;
+}
+
+static int entry_changed(const struct proc_entry *a, const struct proc_entry *b)
+{
+	return a->uid != b->uid || strcmp(a->name, b->name) != 0 ||
+		strcmp(a->state, b->state) != 0 ||
+		ul_diff(a->rss, b->rss) >= MEM_THRESHOLD ||
+		ul_diff(a->swap, b->swap) >= MEM_THRESHOLD ||
+		fabs(a->cpu - b->cpu) >= CPU_THRESHOLD;
+}
+
+/* Merge walk over both pid-sorted tables, returns the number of changes. */
+int proc_snapshot_diff(const struct proc_snapshot *from, const struct proc_snapshot *to,
+		proc_diff_cb cb, void *data)
+{
+	int i = 0, j = 0, n = 0;
+
+	assert(from && to);
+
+	while (i < from->n || j < to->n) {
+		if (j == to->n || (i < from->n && from->entries[i].pid < to->entries[j].pid)) {
+			cb(PROC_REMOVED, &from->entries[i++], data);
+		} else if (i == from->n || to->entries[j].pid < from->entries[i].pid) {
+			cb(PROC_ADDED, &to->entries[j++], data);
+		} else {
+			if (entry_changed(&from->entries[i], &to->entries[j]))
+				cb(PROC_CHANGED, &to->entries[j], data);
+			else
+				--n;
+			++i;
+			++j;
+		}
+		++n;
+	}
+
+	return n;
+}
+
+struct proc_history *proc_history_new(void)
+{
+	struct proc_history *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return NULL;
+
+	h->clk_tck = sysconf(_SC_CLK_TCK);
+	h->ticks.size = 512;
+	h->ticks.slots = calloc(h->ticks.size, sizeof(*h->ticks.slots));
+	if (h->ticks.slots == NULL || h->clk_tck <= 0) {
+		free(h->ticks.slots);
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+void proc_history_free(struct proc_history *h)
+{
+	int i;
+
+	if (h == NULL)
+		return;
+	for (i = 0; i < PROC_HISTORY_MAX; ++i)
+		proc_snapshot_free(h->snaps[i]);
+	free(h->ticks.slots);
+	free(h);
+}
+
+/*
+ * Returns the last snapshot if it is less than 'reuse_ms' old, takes a new
+ * one otherwise. Snapshots older than PROC_HISTORY_AGE are dropped.
+ */
+const struct proc_snapshot *proc_history_take(struct proc_history *h, unsigned int reuse_ms)
+{
+	struct proc_snapshot *snap, *last;
+	int64_t now = monotonic_ms();
+	int i;
+
+	assert(h);
+
+	last = h->snaps[(h->head + PROC_HISTORY_MAX - 1) % PROC_HISTORY_MAX];
+	if (last && now - last->ms < reuse_ms)
+		return last;
+
+	snap = proc_snapshot_take(h, now);
+	if (snap == NULL)
+		return NULL;
+
+	snap->seq = ++h->seq;
+	proc_snapshot_free(h->snaps[h->head]);
+	h->snaps[h->head] = snap;
+	h->head = (h->head + 1) % PROC_HISTORY_MAX;
+
+	for (i = 0; i < PROC_HISTORY_MAX; ++i)
+		if (h->snaps[i] && now - h->snaps[i]->ms > PROC_HISTORY_AGE * 1000) {
+			proc_snapshot_free(h->snaps[i]);
+			h->snaps[i] = NULL;
+		}
+
+	return snap;
+}
+
+const struct proc_snapshot *proc_history_find(const struct proc_history *h, unsigned int seq)
+{
+	int i;
+
+	assert(h);
+
+	for (i = 0; i < PROC_HISTORY_MAX; ++i)
+		if (h->snaps[i] && h->snaps[i]->seq == seq)
+			return h->snaps[i];
+
+	return NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef __PROCTAB_H
+#define __PROCTAB_H
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Process table snapshots. Every snapshot taken through a proc_history gets
+ * a sequence number and is kept around for a while, so a client that still
+ * holds one of them can be sent only what changed since. They are kept by
+ * age rather than by count - many clients polling must not push each
+ * other's base out - and PROC_HISTORY_MAX only bounds the memory.
+ *
+ * The history also remembers the CPU ticks each pid had consumed at an
+ * earlier snapshot at least a second back, so per-process CPU usage comes
+ * from the difference between two snapshots instead of sleeping between
+ * two reads.
+ */
+
+#define PROC_HISTORY_AGE	30	/* s */
+#define PROC_HISTORY_MAX	64
+
+struct proc_entry {
+	pid_t pid;
+	uid_t uid;
+	char name[32];
+	char state[32];
+	double cpu;			/* % of one CPU over the last second or more */
+	unsigned long rss;		/* kB */
+	unsigned long swap;		/* kB */
+};
+
+struct proc_snapshot {
+	unsigned int seq;
+	int64_t ms;			/* CLOCK_MONOTONIC when taken */
+	int n;
+	struct proc_entry *entries;	/* sorted by pid */
+};
+
+enum proc_change {
+	PROC_ADDED,
+	PROC_REMOVED,
+	PROC_CHANGED,
+};
+
+typedef void (*proc_diff_cb)(enum proc_change change, const struct proc_entry *entry, void *data);
+
+int proc_snapshot_diff(const struct proc_snapshot *from, const struct proc_snapshot *to,
+		proc_diff_cb cb, void *data);
+
+struct proc_history;
+
+struct proc_history *proc_history_new(void);
+void proc_history_free(struct proc_history *h);
+const struct proc_snapshot *proc_history_take(struct proc_history *h, unsigned int reuse_ms);
+const struct proc_snapshot *proc_history_find(const struct proc_history *h, unsigned int seq);
+
+#endif /* __PROCTAB_H */
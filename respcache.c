@@ -0,0 +1,203 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "respcache.h"
+
+#include <string.h>
+
+/* expired entries are swept when the table grows past this */
+#define RESPCACHE_SWEEP_SIZE 64
+
+struct respcache {
+  GMutex lock;
+  GHashTable *entries;          /* "cmd args" -> struct respcache_entry */
+  GHashTable *generations;      /* "cmd" -> invalidations so far */
+};
+
+struct respcache_entry {
+  gchar *cmd;
+  struct msgbuf *msg;
+  gint64 expires;               /* monotonic us */
+};
+
+
+static void
+respcache_entry_free (gpointer data)
+{
+  struct respcache_entry *entry = data;
+
+  g_free (entry->cmd);
+  msgbuf_unref (entry->msg);
+  g_free (entry);
+}
+
+
+/*
+ * respcache_new()
+ */
+struct respcache *
+respcache_new (void)
+{
+  struct respcache *cache;
+
+  cache = g_new0 (struct respcache, 1);
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, respcache_entry_free);
+  cache->generations = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  return cache;
+}
+
+
+/*
+ * respcache_free()
+ */
+void
+respcache_free (struct respcache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  g_hash_table_destroy (cache->entries);
+  g_hash_table_destroy (cache->generations);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+
+/*
+ * respcache_key()
+ *
+ * The same response is cached once per encoding.
+ */
+gchar *
+respcache_key (const char *cmd, const char *args, enum msgbuf_encoding encoding)
+{
+  return g_strdup_printf ("%s %u %s", cmd, (guint) encoding, args);
+}
+
+
+/*
+ * respcache_lookup()
+ *
+ * Returns a new reference to the cached response or NULL.
+ */
+struct msgbuf *
+respcache_lookup (struct respcache *cache, const char *cmd, const char *args,
+                  enum msgbuf_encoding encoding)
+{
+  struct respcache_entry *entry;
+  struct msgbuf *msg = NULL;
+  gchar *key;
+
+  key = respcache_key (cmd, args, encoding);
+
+  g_mutex_lock (&cache->lock);
+  entry = g_hash_table_lookup (cache->entries, key);
+  if (entry != NULL && entry->expires <= g_get_monotonic_time ())
+    g_hash_table_remove (cache->entries, key);
+  else if (entry != NULL)
+    msg = msgbuf_ref (entry->msg);
+  g_mutex_unlock (&cache->lock);
+
+  g_free (key);
+  return msg;
+}
+
+
+static gboolean
+respcache_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  return ((struct respcache_entry *) value)->expires <= *(gint64 *) user_data;
+}
+
+
+/*
+ * respcache_store()
+ *
+ * 'ttl' is in ms, the cache takes its own reference to 'msg'. 'generation'
+ * is the one of 'cmd' when 'msg' started being computed, nothing is
+ * stored if 'cmd' was invalidated since.
+ */
+void
+respcache_store (struct respcache *cache, const char *cmd, const char *args,
+                 struct msgbuf *msg, guint ttl, guint generation)
+{
+  struct respcache_entry *entry;
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&cache->lock);
+  if (GPOINTER_TO_UINT (g_hash_table_lookup (cache->generations, cmd)) != generation)
+    {
+      g_mutex_unlock (&cache->lock);
+      return;
+    }
+
+  entry = g_new (struct respcache_entry, 1);
+  entry->cmd = g_strdup (cmd);
+  entry->msg = msgbuf_ref (msg);
+  entry->expires = now + (gint64) ttl * 1000;
+
+  if (g_hash_table_size (cache->entries) >= RESPCACHE_SWEEP_SIZE)
+    g_hash_table_foreach_remove (cache->entries, respcache_expired, &now);
+  g_hash_table_replace (cache->entries, respcache_key (cmd, args, msg->encoding), entry);
+  g_mutex_unlock (&cache->lock);
+}
+
+
+static gboolean
+respcache_match (gpointer key, gpointer value, gpointer user_data)
+{
+  return strcmp (((struct respcache_entry *) value)->cmd, user_data) == 0;
+}
+
+
+/*
+ * respcache_invalidate()
+ *
+ * Drops every cached response of 'cmd', whatever its arguments.
+ */
+void
+respcache_invalidate (struct respcache *cache, const char *cmd)
+{
+  guint generation;
+
+  g_mutex_lock (&cache->lock);
+  g_hash_table_foreach_remove (cache->entries, respcache_match, (gpointer) cmd);
+  generation = GPOINTER_TO_UINT (g_hash_table_lookup (cache->generations, cmd));
+  g_hash_table_replace (cache->generations, g_strdup (cmd), GUINT_TO_POINTER (generation + 1));
+  g_mutex_unlock (&cache->lock);
+}
+
+
+/*
+ * respcache_generation()
+ *
+ * To be read before computing a response of 'cmd' to store.
+ */
+guint
+respcache_generation (struct respcache *cache, const char *cmd)
+{
+  guint generation;
+
+  g_mutex_lock (&cache->lock);
+  generation = GPOINTER_TO_UINT (g_hash_table_lookup (cache->generations, cmd));
+  g_mutex_unlock (&cache->lock);
+
+  return generation;
+}
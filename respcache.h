@@ -0,0 +1,47 @@
+/* Raspberry Control - Control Raspberry Pi with your Android Device
+ *
+ * Copyright (C) Lukasz Skalski <lukasz.skalski@op.pl>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __RESPCACHE_H
+#define __RESPCACHE_H
+
+#include <glib.h>
+#include "msgbuf.h"
+
+/*
+ * Serialized responses of read-only commands, keyed by command,
+ * arguments and encoding. Each entry lives for the TTL it was stored with, or until its
+ * command is invalidated by a write. The cache may be used from any thread.
+ *
+ * Every invalidation of a command bumps its generation. A response is
+ * stored with the generation read before it was computed and dropped if a
+ * write came in between - it may predate the write.
+ */
+struct respcache;
+
+struct respcache *respcache_new (void);
+void respcache_free (struct respcache *cache);
+struct msgbuf *respcache_lookup (struct respcache *cache, const char *cmd, const char *args,
+                                 enum msgbuf_encoding encoding);
+void respcache_store (struct respcache *cache, const char *cmd, const char *args,
+                      struct msgbuf *msg, guint ttl, guint generation);
+void respcache_invalidate (struct respcache *cache, const char *cmd);
+guint respcache_generation (struct respcache *cache, const char *cmd);
+gchar *respcache_key (const char *cmd, const char *args, enum msgbuf_encoding encoding);
+
+#endif /* __RESPCACHE_H */
@@ -21,17 +21,31 @@
 
 #include "util.h"
 #include "devman.h"
-
+#include "w1.h"
+#include "proctab.h"
+#include "stathist.h"
+#include "uidcache.h"
+#include "gpio.h"
+#include "lirc.h"
+#include "irseq.h"
+#include "msgbuf.h"
+#include "cbor.h"
+#include "jsonw.h"
+#include "respcache.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <math.h>
 #include <inttypes.h>
 #include <gio/gio.h>
 #include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <syslog.h>
-#include <ctype.h>
-#include <dirent.h>
-#include <pwd.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 #include <jansson.h>
 #include <libwebsockets.h>
 
@@ -39,29 +53,71 @@
 #include <systemd/sd-journal.h>
 #endif
 
-#define MAX_PAYLOAD 10000
+#define MAX_PAYLOAD 10000 /* largest accepted request */
+#define FRAGMENT_SIZE 4096
+#define CPU_SAMPLE_INTERVAL 1000 /* ms */
+#define SUBSCRIPTION_COUNT 4
+#define MIN_SUBSCRIPTION_INTERVAL 100 /* ms */
+#define MAX_PENDING_EVENTS 64
+#define MAX_PENDING_REQUESTS 16
+#define NOTIFICATION_RING_SIZE 128
+#define PROC_SNAPSHOT_REUSE 500 /* ms */
+
+/* outbound queue keys */
+#define OUT_RESPONSE 0
+#define OUT_EVENT 1
+#define OUT_NOTIFICATION 2
+#define OUT_SUBSCRIPTION(i) (3 + (i))
 
 
 /*
  * Global variables
  */
 static struct libwebsocket_context *context;
+static struct cpu_sampler *cpu_sampler;
+static struct devman_ctx *devman;
+static struct gpio_table *gpio_table;
+static GHashTable *gpio_watchers;
+static struct proc_history *proc_history;
+static struct stat_history *stat_history;    /* main loop only */
+static struct lirc_client *lirc;
+static struct ir_macros *ir_macros;
+static struct respcache *response_cache;
+static GHashTable *inflight;                 /* main loop only */
+static GThreadPool *workers;
+static GThreadPool *ir_senders;              /* one thread */
+static GMutex proc_lock;                     /* proc_history, uid cache */
+static GMutex sysinfo_lock;                  /* devman, cpu_sampler */
+static GMainLoop *main_loop;
+static GHashTable *lws_watches;
+static gint64 loop_woken;
+
+static struct {
+  guint64 bytes_written;
+  guint64 messages_written;
+  guint64 partial_writes;
+  struct histogram write_latency;
+  struct histogram loop_busy;
+} server_metrics;
+static GList *sessions;
 char board_revision[4];
-char *notification;
 
 gboolean opt_use_ssl = FALSE;
 gboolean opt_no_daemon = FALSE;
 gboolean opt_show_json_obj = FALSE;
-gboolean exit_loop = FALSE;
-gboolean send_notification = FALSE; 
+gboolean opt_no_deflate = FALSE;
 gint port = 8080;
-
-
-/*
- * Supported 1-wire temperature sensors
- */
-#define DS18B20_CODE	"28"
-#define DS1820_CODE	"10"
+gint max_queue = 1048576;
+gint max_workers = 4;
+gint sysinfo_refresh = 1000;
+gint w1_read_interval = 10;
+gint stats_interval = 5;
+gint stats_sync_interval = 900;
+gint w1_rescan_interval = 300;
+gchar *opt_gpio_path = NULL;
+gchar *opt_lirc_socket = NULL;
+gchar *opt_ir_macros = NULL;
+gchar *opt_stats_file = NULL;
 
 
 /*
@@ -72,20 +128,115 @@ GOptionEntry entries[] =
   { "use-ssl", 's', 0, G_OPTION_ARG_NONE, &opt_use_ssl, "Use SSL to encrypt the connection between client and server", NULL},
   { "no-daemon", 'n', 0, G_OPTION_ARG_NONE, &opt_no_daemon, "Don't detach Raspberry Control into the background", NULL},
   { "show-json", 'j', 0, G_OPTION_ARG_NONE, &opt_show_json_obj, "Show JSON objects in daemon log file", NULL},
+  { "no-deflate", 0, 0, G_OPTION_ARG_NONE, &opt_no_deflate, "Don't compress websocket messages - saves compressing every broadcast once per client", NULL},
   { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port number [default: 8080]", NULL },
+  { "max-queue", 0, 0, G_OPTION_ARG_INT, &max_queue, "Bytes queued for a client before its requests are throttled [default: 1048576]", NULL },
+  { "workers", 0, 0, G_OPTION_ARG_INT, &max_workers, "Threads running blocking commands [default: 4]", NULL },
+  { "sysinfo-refresh", 0, 0, G_OPTION_ARG_INT, &sysinfo_refresh, "Milliseconds an uptime, load and memory reading is reused for [default: 1000]", NULL },
+  { "w1-interval", 0, 0, G_OPTION_ARG_INT, &w1_read_interval, "Seconds between 1-wire sensor readings [default: 10]", NULL },
+  { "w1-rescan", 0, 0, G_OPTION_ARG_INT, &w1_rescan_interval, "Seconds between forced 1-wire bus rescans, 0 for none [default: 300]", NULL },
+  { "stats-interval", 0, 0, G_OPTION_ARG_INT, &stats_interval, "Seconds between statistics history samples, a divisor of 60 [default: 5]", NULL },
+  { "stats-file", 0, 0, G_OPTION_ARG_FILENAME, &opt_stats_file, "Statistics history file [default: " STAT_FILE_DEFAULT_PATH "]", NULL },
+  { "stats-sync", 0, 0, G_OPTION_ARG_INT, &stats_sync_interval, "Seconds between writes of the statistics history to its file - as much history is lost on a power cut [default: 900]", NULL },
+  { "gpio-path", 0, 0, G_OPTION_ARG_FILENAME, &opt_gpio_path, "GPIO sysfs directory [default: /sys/class/gpio]", NULL },
+  { "lirc-socket", 0, 0, G_OPTION_ARG_FILENAME, &opt_lirc_socket, "lircd socket [default: " LIRC_DEFAULT_SOCKET "]", NULL },
+  { "ir-macros", 0, 0, G_OPTION_ARG_FILENAME, &opt_ir_macros, "IR macros file [default: " IR_MACROS_DEFAULT_PATH "]", NULL },
   { NULL }
 };
 
 
 /*
- * Static buffer
+ * Per session data
  */
 struct per_session_data {
-  unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + MAX_PAYLOAD + LWS_SEND_BUFFER_POST_PADDING];
-  unsigned int len;
-  unsigned int index;
+  struct libwebsocket *wsi;
+  struct msgbuf *tx;                         /* message being sent */
+  size_t tx_offset;                          /* bytes of it already sent */
+  GQueue outq;                               /* struct out_entry, waiting for tx */
+  gsize out_bytes;                           /* queued bytes, tx included */
+  guint out_events;                          /* GPIO edge events in outq */
+  GQueue requests;                           /* struct request, the head one is running */
+  gboolean rx_paused;
+  enum msgbuf_encoding encoding;             /* of everything sent and received */
+  guint sub_interval[SUBSCRIPTION_COUNT];    /* ms, 0 if not subscribed */
+  gint64 sub_next[SUBSCRIPTION_COUNT];       /* monotonic ms of the next push */
+  guint64 notify_cursor;                     /* seq of the last notification queued */
+  gboolean notify_queued;                    /* one is in outq */
+};
+
+struct out_entry {
+  struct msgbuf *msg;
+  guint key;                                 /* OUT_* */
+};
+
+
+/*
+ * Command registry entry
+ */
+typedef unsigned int (*command_handler) (struct libwebsocket *wsi, struct per_session_data *psd,
+                                         struct msgbuf *out, char *args);
+
+/* answers later, with request_finish() */
+struct request;
+typedef void (*command_starter) (struct request *req, char *args);
+
+#define CMD_CACHEABLE (1 << 0)                /* read-only, response kept for 'ttl' */
+#define CMD_BLOCKING  (1 << 1)                /* may wait for I/O or a child process, run by a worker */
+#define CMD_BATCHABLE (1 << 2)                /* allowed in RunCommands */
+#define CMD_ASYNC     (1 << 3)                /* started in the main loop, 'start' in place of 'handler' */
+
+struct command_stats {
+  guint64 calls;
+  guint64 errors;
+  guint64 cache_hits;
+  struct histogram latency;                  /* time spent in the handler */
+};
+
+struct command {
+  const char *name;
+  command_handler handler;
+  const char *usage;                         /* argument schema */
+  guint min_args;
+  guint max_args;
+  guint flags;                               /* CMD_* */
+  guint ttl;                                 /* ms */
+  command_starter start;                     /* CMD_ASYNC */
+  struct command_stats stats;
 };
 
+static struct command *command_find (const char *name);
+
+
+/*
+ * Request being run
+ */
+struct request {
+  struct libwebsocket *wsi;
+  struct per_session_data *psd;              /* NULL if not sent by a client */
+  json_t *root;                              /* parsed request, owns the strings */
+  json_t *commands;                          /* RunCommands array, NULL for one command */
+  const char *cmd_str;
+  char *args_str;
+  size_t count;                              /* commands to run */
+  size_t next;                               /* the one running */
+  struct msgbuf *out;                        /* response */
+  struct command *command;                   /* handed to a worker, NULL otherwise */
+  char *args;
+  size_t start;                              /* out->len before its result */
+  unsigned int len;                          /* its result */
+  gint64 t0;
+  guint generation;                          /* of the cached command when it started */
+  gboolean cancelled;                        /* session closed meanwhile */
+  gchar *flight;                             /* key of the response it computes for others */
+  void (*done) (struct request *req);        /* called once complete */
+  gpointer data;
+};
+
+static struct request *request_new (struct libwebsocket *wsi, struct per_session_data *psd,
+                                    enum msgbuf_encoding encoding);
+static void request_run (struct request *req);
+static void request_finish (struct request *req, unsigned int len);
+
 
 /*
  *  print_log()
@@ -120,8 +271,145 @@ print_log (gint msg_priority, const gchar *msg, ...)
 static gboolean
 sigint_handler ()
 {
-  libwebsocket_cancel_service (context);
-  exit_loop = TRUE;
+  g_main_loop_quit (main_loop);
+  return TRUE;
+}
+
+
+/*
+ * Main loop
+ *
+ * libwebsockets runs in external poll mode: every descriptor it wants
+ * polled is reported through the *_POLL_FD callbacks and gets a GLib watch,
+ * so a single poll() in the GLib main loop waits for websocket traffic,
+ * D-Bus, timers and GPIO edges alike instead of a 10 ms polling tick.
+ */
+struct lws_watch {
+  guint source_id;
+  int events;                                /* POLLIN / POLLOUT */
+};
+
+
+/*
+ * loop_poll()
+ *
+ * Everything between two polls is time spent handling events.
+ */
+static gint
+loop_poll (GPollFD *ufds, guint nfds, gint timeout)
+{
+  gint ret;
+
+  if (loop_woken > 0)
+    histogram_record (&server_metrics.loop_busy, g_get_monotonic_time () - loop_woken);
+
+  ret = g_poll (ufds, nfds, timeout);
+  loop_woken = g_get_monotonic_time ();
+  return ret;
+}
+
+
+/*
+ * lws_fd_callback()
+ */
+static gboolean
+lws_fd_callback (GIOChannel *channel, GIOCondition condition, gpointer user_data)
+{
+  struct lws_watch *watch = user_data;
+  struct pollfd pfd;
+
+  pfd.fd = g_io_channel_unix_get_fd (channel);
+  pfd.events = watch->events;
+  pfd.revents = 0;
+  if (condition & G_IO_IN)
+    pfd.revents |= POLLIN;
+  if (condition & G_IO_OUT)
+    pfd.revents |= POLLOUT;
+  if (condition & G_IO_HUP)
+    pfd.revents |= POLLHUP;
+  if (condition & G_IO_ERR)
+    pfd.revents |= POLLERR;
+
+  /* may drop this very watch through LWS_CALLBACK_DEL_POLL_FD */
+  libwebsocket_service_fd (context, &pfd);
+  return TRUE;
+}
+
+
+/*
+ * lws_timeout_tick()
+ *
+ * libwebsockets checks its connection timeouts when serviced without a
+ * descriptor.
+ */
+static gboolean
+lws_timeout_tick (gpointer user_data)
+{
+  libwebsocket_service_fd (context, NULL);
+  return TRUE;
+}
+
+
+/*
+ * lws_watch_set()
+ */
+static void
+lws_watch_set (int fd, int events)
+{
+  struct lws_watch *watch;
+  GIOChannel *channel;
+  GIOCondition condition = G_IO_HUP | G_IO_ERR;
+
+  watch = g_hash_table_lookup (lws_watches, GINT_TO_POINTER (fd));
+  if (watch == NULL)
+    {
+      watch = g_new0 (struct lws_watch, 1);
+      g_hash_table_insert (lws_watches, GINT_TO_POINTER (fd), watch);
+    }
+  else if (watch->events == events)
+    return;
+  else
+    g_source_remove (watch->source_id);
+
+  if (events & POLLIN)
+    condition |= G_IO_IN;
+  if (events & POLLOUT)
+    condition |= G_IO_OUT;
+
+  channel = g_io_channel_unix_new (fd);
+  watch->events = events;
+  watch->source_id = g_io_add_watch (channel, condition, lws_fd_callback, watch);
+  g_io_channel_unref (channel);
+}
+
+
+/*
+ * lws_watch_free()
+ */
+static void
+lws_watch_free (gpointer data)
+{
+  struct lws_watch *watch = data;
+
+  g_source_remove (watch->source_id);
+  g_free (watch);
+}
+
+
+/*
+ * cpu_sampler_tick()
+ */
+static gboolean
+cpu_sampler_tick (gpointer user_data)
+{
+  gint ret;
+
+  g_mutex_lock (&sysinfo_lock);
+  ret = cpu_sampler_update (cpu_sampler);
+  g_mutex_unlock (&sysinfo_lock);
+
+  if (ret < 0)
+    print_log (LOG_ERR, "(main) unable to sample /proc/stat\n");
   return TRUE;
 }
 
@@ -167,379 +455,691 @@ gboolean check_board_revision ()
 
 
 /*
- * dbus_notification_callback()
+ * Outbound queue
+ *
+ * Everything sent to a client goes through its FIFO. Command responses are
+ * never dropped - once more than max_queue bytes or MAX_PENDING_REQUESTS
+ * requests are waiting, the session stops reading requests until both
+ * drop to half of that. Subscription snapshots replace a queued message
+ * with the same key, so a slow client only gets the latest value, and a
+ * client which doesn't keep up with GPIO edges loses the oldest ones.
+ * Notifications are never replaced, a session has at most one queued and
+ * takes the next from the notification ring once it is sent.
  */
-void dbus_notification_callback (GDBusConnection  *connection,
-                                 const gchar      *sender_name,
-                                 const gchar      *object_path,
-                                 const gchar      *interface_name,
-                                 const gchar      *signal_name,
-                                 GVariant         *parameters,
-                                 gpointer          user_data)
-{
-  json_t *notification_obj;
-  char *notification_msg;
 
-  print_log (LOG_INFO, "(notification) NOTIFICATION\n");
+static void session_notify (struct per_session_data *psd);
 
-  send_notification = FALSE;
-  notification_msg = NULL;
-  free (notification);
+/*
+ * session_unlink()
+ */
+static void
+session_unlink (struct per_session_data *psd, GList *link)
+{
+  struct out_entry *entry = link->data;
 
-  /* UDisk - 'DeviceAdded' */
-  if ((strcmp(interface_name, "org.freedesktop.UDisks") == 0) &&
-      (strcmp(signal_name, "DeviceAdded") == 0))
-      asprintf (&notification_msg, "[UDisks] %s", signal_name);
+  if (entry->key == OUT_EVENT)
+    psd->out_events--;
+  if (entry->key == OUT_NOTIFICATION)
+    psd->notify_queued = FALSE;
+  psd->out_bytes -= entry->msg->len;
 
-  /* CUPS - 'JobQueuedLocal' */
-  if (strcmp(signal_name, "JobQueuedLocal") == 0)
-    asprintf (&notification_msg, "[CUPS] %s", signal_name);
+  msgbuf_unref (entry->msg);
+  g_free (entry);
+  g_queue_delete_link (&psd->outq, link);
+}
 
-  if (!notification_msg)
-    asprintf (&notification_msg, "(not set)");
 
-  notification_obj = json_pack ("{s:s}", "Notification", notification_msg);
-  notification = json_dumps (notification_obj, 0);
+/*
+ * session_find()
+ */
+static GList *
+session_find (struct per_session_data *psd, guint key)
+{
+  GList *l;
+
+  for (l = psd->outq.head; l; l = l->next)
+    if (((struct out_entry *) l->data)->key == key)
+      return l;
 
-  free (notification_msg);
-  json_decref (notification_obj);
-  send_notification = TRUE;
+  return NULL;
 }
 
 
 /*
- * dbus_set_notification()
+ * session_throttle()
+ *
+ * Stops or resumes reading requests from the client.
  */
-void
-dbus_set_notification (GDBusConnection  *connection,
-                       const gchar      *sender,
-                       const gchar      *interface_name,
-                       const gchar      *member,
-                       const gchar      *object_path)
+static void
+session_throttle (struct per_session_data *psd)
 {
-  print_log (LOG_INFO, "(notification) new notification subscription\n");
-  g_dbus_connection_signal_subscribe (connection,
-                                      sender,
-                                      interface_name,
-                                      member,
-                                      object_path,
-                                      NULL,
-                                      G_DBUS_SIGNAL_FLAGS_NONE,
-                                      dbus_notification_callback,
-                                      NULL,
-                                      NULL);
-  /* TODO - collect all subscription identifiers */
+  guint pending = g_queue_get_length (&psd->requests);
+  gboolean busy;
+
+  if (psd->rx_paused)
+    busy = psd->out_bytes > (gsize) max_queue / 2 || pending > MAX_PENDING_REQUESTS / 2;
+  else
+    busy = psd->out_bytes > (gsize) max_queue || pending >= MAX_PENDING_REQUESTS;
+
+  if (busy == psd->rx_paused)
+    return;
+
+  if (busy)
+    print_log (LOG_INFO, "(%p) (callback) %u bytes and %u requests queued, throttling requests\n",
+               psd->wsi, (unsigned) psd->out_bytes, pending);
+
+  libwebsocket_rx_flow_control (psd->wsi, !busy);
+  psd->rx_paused = busy;
 }
 
 
 /*
- * send_error()
- *
- * JSON Object
- * ===========
- *
- * {
- *   "Error" : "Can't open device"
- * }
+ * session_enqueue()
  */
-unsigned int
-send_error (unsigned char *buffer, const char *error)
+static void
+session_enqueue (struct per_session_data *psd, struct msgbuf *msg, guint key)
 {
-  json_t *error_obj;
-  char *error_str;
-  int error_len;
+  struct out_entry *entry;
+  GList *link;
+
+  if (key >= OUT_SUBSCRIPTION (0) && (link = session_find (psd, key)))
+    {
+      /* coalesce - the queued one hasn't been sent yet, it keeps its place */
+      entry = link->data;
+      psd->out_bytes -= entry->msg->len;
+      psd->out_bytes += msg->len;
+      msgbuf_unref (entry->msg);
+      entry->msg = msgbuf_ref (msg);
+      return;
+    }
+
+  if (key == OUT_EVENT && psd->out_events >= MAX_PENDING_EVENTS)
+    session_unlink (psd, session_find (psd, OUT_EVENT));
 
-  error_obj = json_pack ("{s:s}", "Error", error);
-  error_str = json_dumps (error_obj, 0);
+  entry = g_new (struct out_entry, 1);
+  entry->msg = msgbuf_ref (msg);
+  entry->key = key;
+  g_queue_push_tail (&psd->outq, entry);
 
-  error_len = strlen (error_str);
-  memcpy (buffer, error_str, error_len);
+  psd->out_bytes += msg->len;
+  if (key == OUT_EVENT)
+    psd->out_events++;
 
-  json_decref (error_obj);
-  free (error_str);
-  return error_len;
+  session_throttle (psd);
+  libwebsocket_callback_on_writable (context, psd->wsi);
 }
 
 
 /*
- * cmd_GetGPIO()
- *
- * JSON Object
- * ===========
+ * session_drop()
  *
- * {
- *   "GPIOState": [
- *     {
- *       "gpio"     : 6,
- *       "value"    : 1,
- *       "direction": "in"
- *     },
- *     {
- *       "gpio"     : 3,
- *       "value"    : 0,
- *       "direction": "out"
- *     },
- *     .
- *     .
- *   ],
- *   "Revision" : "0002"
- * }
+ * Forgets a queued state update.
  */
-unsigned int
-cmd_GetGPIO (struct libwebsocket *wsi, unsigned char *buffer)
+static void
+session_drop (struct per_session_data *psd, guint key)
 {
-  json_t *gpio_obj;
-  json_t *gpio_array_obj;
+  GList *link;
+
+  link = session_find (psd, key);
+  if (link != NULL)
+    session_unlink (psd, link);
+}
 
-  DIR *gpio_dir;
-  FILE *fd, *fp;
-  struct dirent *gpio_num_dir;
 
-  char filepath [PATH_MAX];
-  char fileline1 [5];
-  char fileline2 [5];
+/*
+ * session_next()
+ */
+static struct msgbuf *
+session_next (struct per_session_data *psd)
+{
+  struct out_entry *entry;
+  struct msgbuf *msg;
 
-  char *gpio_str;
-  int gpio_len;
+  entry = g_queue_pop_head (&psd->outq);
+  if (entry == NULL)
+    return NULL;
 
-  print_log (LOG_INFO, "(%p) (cmd_GetGPIO) processing request\n", wsi);
+  if (entry->key == OUT_EVENT)
+    psd->out_events--;
 
-  gpio_dir = opendir ("/sys/class/gpio");
-  if (gpio_dir == NULL)
+  msg = entry->msg;
+  if (entry->key == OUT_NOTIFICATION)
     {
-      print_log (LOG_ERR, "(%p) (cmd_GetGPIO) unable to read the list of exported GPIO's\n", wsi);
-      return send_error (buffer, "Unable to read the list of exported GPIO's");
+      /* the next one takes its place */
+      psd->notify_queued = FALSE;
+      session_notify (psd);
     }
 
-  gpio_obj = json_object();
-  gpio_array_obj = json_array();
+  g_free (entry);
+  return msg;
+}
 
-  while(1)
-    {
-      json_t *gpio_num_obj;
 
-      gpio_num_dir = readdir (gpio_dir);
-      if (gpio_num_dir == NULL)
-        break;
+/*
+ * session_sent()
+ */
+static void
+session_sent (struct per_session_data *psd)
+{
+  psd->out_bytes -= psd->tx->len;
+  msgbuf_unref (psd->tx);
+  psd->tx = NULL;
+  psd->tx_offset = 0;
 
-      if ((gpio_num_dir->d_type != DT_LNK))
-        continue;
+  session_throttle (psd);
+}
 
-      if (strncmp (gpio_num_dir->d_name, "gpio", 4) != 0)
-        continue;
 
-      /* read 'value' */
-      snprintf (filepath, PATH_MAX, "/sys/class/gpio/%s/value", gpio_num_dir->d_name);
-      fd = fopen (filepath, "r");
-      if (fd == NULL)
-        continue;
+/*
+ * session_flush()
+ */
+static void
+session_flush (struct per_session_data *psd)
+{
+  while (!g_queue_is_empty (&psd->outq))
+    session_unlink (psd, psd->outq.head);
 
-      /* read 'direction' */
-      snprintf (filepath, PATH_MAX, "/sys/class/gpio/%s/direction", gpio_num_dir->d_name);
-      fp = fopen (filepath, "r");
-      if (fp == NULL)
-        {
-          fclose (fd);
-          continue;
-        }
+  msgbuf_unref (psd->tx);
+  psd->tx = NULL;
+  psd->out_bytes = 0;
+}
 
-      fgets (fileline1, 5, fd);
-      fgets (fileline2, 5, fp);
-      fileline2 [strlen(fileline2)-1] = 0;
 
-      gpio_num_obj = json_pack ("{s:i, s:i, s:s}",
-                                "gpio", atoi ((gpio_num_dir->d_name) + 4),
-                                "value", atoi (fileline1),
-                                "direction", fileline2);
+/*
+ * Broadcasts
+ *
+ * A message for many sessions is built once per encoding, the first time
+ * a session of that encoding comes up, and the same buffer is queued for
+ * all of them - the cost of a broadcast doesn't grow with the number of
+ * clients. The compression extension still deflates it per connection,
+ * its state is per connection; --no-deflate turns that off.
+ */
+struct broadcast {
+  struct msgbuf *(*build) (enum msgbuf_encoding encoding, gpointer data);
+  gpointer data;
+  guint key;                                 /* OUT_* */
+  struct msgbuf *msgs[MSGBUF_ENCODINGS];     /* built so far */
+  gboolean failed[MSGBUF_ENCODINGS];
+};
 
-      json_array_append (gpio_array_obj, gpio_num_obj);
-      json_decref (gpio_num_obj);
 
-      fclose (fd);
-      fclose (fp);
-    }
+/*
+ * broadcast_send()
+ */
+static void
+broadcast_send (struct broadcast *b, struct per_session_data *psd)
+{
+  enum msgbuf_encoding encoding = psd->encoding;
 
-  json_object_set_new (gpio_obj, "Revision", json_string (board_revision));
-  json_object_set (gpio_obj, "GPIOState", gpio_array_obj);
-  if (gpio_obj == NULL)
+  if (b->msgs[encoding] == NULL && !b->failed[encoding])
     {
-      print_log (LOG_ERR, "(%p) (cmd_GetGPIO) can't prepare valid JSON object\n", wsi);
-      json_decref (gpio_array_obj);
-      json_decref (gpio_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
+      b->msgs[encoding] = b->build (encoding, b->data);
+      b->failed[encoding] = b->msgs[encoding] == NULL;
     }
 
-  gpio_str = json_dumps (gpio_obj, 0);
-  if (gpio_str == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_GetGPIO) can't prepare valid JSON object\n", wsi);
-      json_decref (gpio_array_obj);
-      json_decref (gpio_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
+  if (b->msgs[encoding] != NULL)
+    session_enqueue (psd, b->msgs[encoding], b->key);
+}
+
+
+/*
+ * broadcast_finish()
+ *
+ * Drops the references of the broadcast, the queues keep theirs.
+ */
+static void
+broadcast_finish (struct broadcast *b)
+{
+  guint i;
 
-  gpio_len = strlen (gpio_str);
-  memcpy (buffer, gpio_str, gpio_len);
+  for (i = 0; i < MSGBUF_ENCODINGS; i++)
+    msgbuf_unref (b->msgs[i]);
+}
+
+
+/*
+ * Notifications
+ *
+ * Every notification gets the next sequence number and goes into a ring
+ * of the last NOTIFICATION_RING_SIZE. A session keeps a cursor, the last
+ * one queued for it, and is handed the next once its queued one is on the
+ * wire - a burst of signals is delivered in full, one write after another,
+ * and a client which lost its connection asks for what it missed with
+ * ResumeNotifications. Numbers start over with the server.
+ */
+struct notification {
+  guint64 seq;
+  gint64 time;                               /* UNIX seconds */
+  gchar *text;
+  struct msgbuf *msgs[MSGBUF_ENCODINGS];     /* built on first use */
+};
 
-  if (opt_show_json_obj)
-    print_log (LOG_INFO, "(%p) (cmd_GetGPIO) %s\n", wsi, gpio_str);
+static struct notification notification_ring [NOTIFICATION_RING_SIZE];
+static guint64 notification_seq;             /* of the last one, 0 before the first */
 
-  json_decref (gpio_array_obj);
-  json_decref (gpio_obj);
-  free (gpio_str);
 
-  return gpio_len;
+/*
+ * notification_first()
+ *
+ * Sequence number of the oldest notification still in the ring.
+ */
+static guint64
+notification_first (void)
+{
+  return notification_seq > NOTIFICATION_RING_SIZE ? notification_seq - NOTIFICATION_RING_SIZE + 1 : 1;
 }
 
 
 /*
- * cmd_GetTempSensors()
+ * notification_build()
  *
  * JSON Object
  * ===========
  *
  * {
- *   "TempSensors": [
- *     {
- *       "type"  : "DS18B20",
- *       "id"    : "28-000002f218f8",
- *       "temp"  : 23.250,
- *       "crc"   : "YES"
- *     },
- *     {
- *       "type" : "DS18S20",
- *       "id"   : "10-000002f1f367",
- *       "temp" : 23.562,
- *       "crc"  : "NO"
- *     },
- *     .
- *     .
- *   ]
+ *   "Notification": "[UDisks] DeviceAdded",
+ *   "Seq"         : 12,
+ *   "timestamp"   : 1397058183
  * }
  */
-unsigned int
-cmd_GetTempSensors (struct libwebsocket *wsi, unsigned char *buffer)
+static struct msgbuf *
+notification_build (struct notification *n, enum msgbuf_encoding encoding)
 {
-  json_t *tempsensors_obj;
-  json_t *tempsensors_array_obj;
-
-  FILE *fd, *fp;
-  DIR *w1_master_dir;
-  struct dirent *w1_device_dir;
+  struct msgbuf *msg;
+  struct jsonw w;
+
+  msg = msgbuf_new (128);
+  if (msg == NULL)
+    return NULL;
+
+  msg->encoding = encoding;
+  jsonw_init (&w, msg);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "Notification");
+  jsonw_string (&w, n->text);
+  jsonw_key (&w, "Seq");
+  jsonw_int (&w, n->seq);
+  jsonw_key (&w, "timestamp");
+  jsonw_int (&w, n->time);
+  jsonw_object_end (&w);
+
+  if (jsonw_finish (&w) <= 0)
+    {
+      msgbuf_unref (msg);
+      return NULL;
+    }
 
-  char filepath [PATH_MAX];
-  char fileline [100];
-  int num_line;
+  return msg;
+}
 
-  char *tempsensors_str;
-  int tempsensors_len;
 
-  print_log (LOG_INFO, "(%p) (cmd_GetTempSensors) processing request\n", wsi);
+/*
+ * session_notify()
+ *
+ * Queues the notification after the session's cursor, unless one is
+ * queued already. A session which fell more than the ring behind skips
+ * what was overwritten, the gap shows in the sequence numbers.
+ */
+static void
+session_notify (struct per_session_data *psd)
+{
+  struct notification *n;
+  enum msgbuf_encoding encoding = psd->encoding;
 
-  /* don't scan 1-wire bus if daemon has limited privileges */
-  if (geteuid() == 0)
-    {
-      /* remove all sensors */
-      fd = fopen("/sys/bus/w1/devices/w1_bus_master1/w1_master_slaves", "r");
-      if (!fd)
-        {
-          print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) unable to read the list of registered 1-wire sensors\n", wsi);
-          return send_error (buffer, "Unable to read the list of registered 1-wire sensors");
-        }
-      while (1)
-        {
-          if (fgets (fileline, 20, fd) == NULL)
-            break;
+  if (psd->notify_queued)
+    return;
 
-          fp = fopen("/sys/bus/w1/devices/w1_bus_master1/w1_master_remove", "w");
-          if (!fp)
-            {
-              print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) unable to remove previously registered 1-wire sensor\n", wsi);
-              fclose (fd);
-              return send_error (buffer, "Unable to remove previously registered 1-wire sensor");
-            }
+  if (psd->notify_cursor + 1 < notification_first ())
+    psd->notify_cursor = notification_first () - 1;
 
-          fprintf (fp, "%s", fileline);
-          fclose (fp);
-        }
-      fclose (fd);
+  while (psd->notify_cursor < notification_seq)
+    {
+      n = &notification_ring[++psd->notify_cursor % NOTIFICATION_RING_SIZE];
 
-      /* rescan 1-wire bus */
-      fd = fopen("/sys/bus/w1/devices/w1_bus_master1/w1_master_search", "w");
-      if (!fd)
-        {
-          print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) unable to rescan 1-wire sensors\n", wsi);
-          return send_error (buffer, "Unable to rescan 1-wire sensors");
-        }
-      fprintf (fd, "1");
-      fclose (fd);
+      if (n->msgs[encoding] == NULL)
+        n->msgs[encoding] = notification_build (n, encoding);
+      if (n->msgs[encoding] == NULL)
+        continue;
 
-      /* we have to wait till all sensors will be available on bus */
-      sleep (1);
+      session_enqueue (psd, n->msgs[encoding], OUT_NOTIFICATION);
+      psd->notify_queued = TRUE;
+      break;
     }
+}
+
+
+/*
+ * notification_post()
+ */
+static void
+notification_post (const gchar *text)
+{
+  struct notification *n;
+  GList *l;
+  guint i;
+
+  n = &notification_ring[++notification_seq % NOTIFICATION_RING_SIZE];
+
+  /* queues still holding the one overwritten keep their references */
+  g_free (n->text);
+  for (i = 0; i < MSGBUF_ENCODINGS; i++)
+    msgbuf_unref (n->msgs[i]);
+  memset (n, 0, sizeof (*n));
+
+  n->seq = notification_seq;
+  n->time = g_get_real_time () / G_USEC_PER_SEC;
+  n->text = g_strdup (text);
+
+  for (l = sessions; l; l = l->next)
+    session_notify (l->data);
+}
 
-  /* read all sensors */
-  w1_master_dir = opendir ("/sys/devices/w1_bus_master1");
-  if (w1_master_dir == NULL)
+
+/*
+ * notifications_free()
+ */
+static void
+notifications_free (void)
+{
+  guint i, j;
+
+  for (i = 0; i < NOTIFICATION_RING_SIZE; i++)
     {
-      print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) can't open 'w1_bus_master1' directory\n", wsi);
-      return send_error (buffer, "Can't open 'w1_bus_master1' directory");
+      g_free (notification_ring[i].text);
+      for (j = 0; j < MSGBUF_ENCODINGS; j++)
+        msgbuf_unref (notification_ring[i].msgs[j]);
     }
 
-  tempsensors_obj = json_object();
-  tempsensors_array_obj = json_array();
+  memset (notification_ring, 0, sizeof (notification_ring));
+}
+
+
+/*
+ * dbus_notification_callback()
+ */
+void dbus_notification_callback (GDBusConnection  *connection,
+                                 const gchar      *sender_name,
+                                 const gchar      *object_path,
+                                 const gchar      *interface_name,
+                                 const gchar      *signal_name,
+                                 GVariant         *parameters,
+                                 gpointer          user_data)
+{
+  char *notification_msg;
+
+  print_log (LOG_INFO, "(notification) NOTIFICATION\n");
+
+  notification_msg = NULL;
+
+  /* UDisk - 'DeviceAdded' */
+  if ((strcmp(interface_name, "org.freedesktop.UDisks") == 0) &&
+      (strcmp(signal_name, "DeviceAdded") == 0))
+      asprintf (&notification_msg, "[UDisks] %s", signal_name);
+
+  /* CUPS - 'JobQueuedLocal' */
+  if (strcmp(signal_name, "JobQueuedLocal") == 0)
+    asprintf (&notification_msg, "[CUPS] %s", signal_name);
+
+  if (!notification_msg)
+    asprintf (&notification_msg, "(not set)");
+
+  notification_post (notification_msg);
+  free (notification_msg);
+}
+
+
+/*
+ * dbus_set_notification()
+ */
+void
+dbus_set_notification (GDBusConnection  *connection,
+                       const gchar      *sender,
+                       const gchar      *interface_name,
+                       const gchar      *member,
+                       const gchar      *object_path)
+{
+  print_log (LOG_INFO, "(notification) new notification subscription\n");
+  g_dbus_connection_signal_subscribe (connection,
+                                      sender,
+                                      interface_name,
+                                      member,
+                                      object_path,
+                                      NULL,
+                                      G_DBUS_SIGNAL_FLAGS_NONE,
+                                      dbus_notification_callback,
+                                      NULL,
+                                      NULL);
+  /* TODO - collect all subscription identifiers */
+}
+
+
+/*
+ * send_error()
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "Error" : "Can't open device"
+ * }
+ */
+unsigned int
+send_error (struct msgbuf *out, const char *error)
+{
+  struct jsonw w;
+  int error_len;
+
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "Error");
+  jsonw_string (&w, error);
+  jsonw_object_end (&w);
+  error_len = jsonw_finish (&w);
 
-  while(1)
+  return error_len < 0 ? 0 : error_len;
+}
+
+
+/*
+ * send_result()
+ *
+ * Accounts for the 'len' bytes of response a handler serialized into
+ * 'out', -1 if it failed to.
+ */
+static unsigned int
+send_result (struct libwebsocket *wsi, struct msgbuf *out, const char *cmd, int len)
+{
+  if (len < 0)
     {
-      json_t *tempsensor_obj;
+      print_log (LOG_ERR, "(%p) (%s) can't prepare valid JSON object\n", wsi, cmd);
+      return send_error (out, "Can't prepare valid JSON object");
+    }
 
-      w1_device_dir = readdir (w1_master_dir);
-      if (w1_device_dir == NULL)
-        break;
+  if (opt_show_json_obj && out->encoding == MSGBUF_JSON)
+    print_log (LOG_INFO, "(%p) (%s) %.*s\n", wsi, cmd, len, (char *) msgbuf_payload (out) + out->len - len);
 
-      if ((w1_device_dir->d_type != DT_DIR))
-        continue;
+  return len;
+}
 
-      if ((strncmp (w1_device_dir->d_name, DS18B20_CODE, 2) != 0) &&
-          (strncmp (w1_device_dir->d_name, DS1820_CODE, 2) != 0))
-        continue;
 
-      snprintf (filepath, PATH_MAX, "/sys/devices/w1_bus_master1/%s/w1_slave", w1_device_dir->d_name);
-      fd = fopen (filepath, "r");
-      if (fd == NULL)
-        continue;
+/*
+ * send_json()
+ *
+ * Serializes a response straight into the outbound message.
+ */
+static unsigned int
+send_json (struct libwebsocket *wsi, struct msgbuf *out, const char *cmd, json_t *obj)
+{
+  return send_result (wsi, out, cmd, msgbuf_append_json (out, obj));
+}
 
-      num_line = 1;
-      tempsensor_obj = json_object();
 
-      while (1)
-        {
-          if (fgets (fileline, 100, fd) == NULL)
-            break;
+/*
+ * send_written()
+ *
+ * Finishes a response streamed into the outbound message.
+ */
+static unsigned int
+send_written (struct libwebsocket *wsi, const char *cmd, struct jsonw *w)
+{
+  return send_result (wsi, w->b, cmd, jsonw_finish (w));
+}
+
+
+/*
+ * cmd_GetGPIO()
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "GPIOState": [
+ *     {
+ *       "gpio"     : 6,
+ *       "value"    : 1,
+ *       "direction": "in"
+ *     },
+ *     {
+ *       "gpio"     : 3,
+ *       "value"    : 0,
+ *       "direction": "out"
+ *     },
+ *     .
+ *     .
+ *   ],
+ *   "Revision" : "0002"
+ * }
+ */
+unsigned int
+cmd_GetGPIO (struct libwebsocket *wsi, struct per_session_data *psd,
+             struct msgbuf *out, char *args)
+{
+  struct jsonw w;
+  struct gpio_pin *pin;
+  char direction [5];
+  int i, value;
 
-          if (strncmp (w1_device_dir->d_name, DS18B20_CODE, 2) == 0)
-            json_object_set_new (tempsensor_obj, "type", json_string ("Dallas DS18B20"));
+  print_log (LOG_INFO, "(%p) (cmd_GetGPIO) processing request\n", wsi);
 
-          if (strncmp (w1_device_dir->d_name, DS1820_CODE, 2) == 0)
-            json_object_set_new (tempsensor_obj, "type", json_string ("Dallas DS1820"));
+  if (gpio_table_refresh (gpio_table) < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_GetGPIO) unable to read the list of exported GPIO's\n", wsi);
+      return send_error (out, "Unable to read the list of exported GPIO's");
+    }
 
-          if (num_line == 1)
-            {
-              json_object_set_new (tempsensor_obj, "id", json_string (w1_device_dir->d_name));
-              fileline [strlen(fileline)-1] = 0;
-              json_object_set_new (tempsensor_obj, "crc", json_string (&fileline[36]));
-            }
-          else if (num_line == 2)
-            {
-              json_object_set_new (tempsensor_obj, "temp", json_real ((atof (&fileline[29])) / 1000));
-            }
-          num_line++;
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "GPIOState");
+  jsonw_array_begin (&w);
+
+  for (i = 0; i < gpio_table->npins; i++)
+    {
+      pin = &gpio_table->pins[i];
+
+      value = gpio_read_value (pin);
+      if (value < 0 || gpio_read_direction (pin, direction, sizeof (direction)) < 0)
+        {
+          /* unexported behind our back - pick it up on the next request */
+          gpio_table->last_scan = 0;
+          continue;
         }
 
+      jsonw_object_begin (&w);
+      jsonw_key (&w, "gpio");
+      jsonw_int (&w, pin->gpio);
+      jsonw_key (&w, "value");
+      jsonw_int (&w, value);
+      jsonw_key (&w, "direction");
+      jsonw_string (&w, direction);
+      jsonw_object_end (&w);
+    }
+
+  jsonw_array_end (&w);
+  jsonw_key (&w, "Revision");
+  jsonw_string (&w, board_revision);
+  jsonw_object_end (&w);
+
+  return send_written (wsi, "cmd_GetGPIO", &w);
+}
+
+
+/*
+ * cmd_GetTempSensors()
+ *
+ * Returns the last reading of every sensor cached by the 1-wire
+ * acquisition engine - 'timestamp' is the time of the reading and 'age'
+ * the number of seconds elapsed since then.
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "TempSensors": [
+ *     {
+ *       "type"     : "DS18B20",
+ *       "id"       : "28-000002f218f8",
+ *       "temp"     : 23.250,
+ *       "crc"      : "YES",
+ *       "timestamp": 1412345678,
+ *       "age"      : 4
+ *     },
+ *     {
+ *       "type"     : "DS18S20",
+ *       "id"       : "10-000002f1f367",
+ *       "temp"     : 23.562,
+ *       "crc"      : "NO",
+ *       "timestamp": 1412345677,
+ *       "age"      : 5
+ *     },
+ *     .
+ *     .
+ *   ]
+ * }
+ */
+unsigned int
+cmd_GetTempSensors (struct libwebsocket *wsi, struct per_session_data *psd,
+                    struct msgbuf *out, char *args)
+{
+  json_t *tempsensors_obj;
+  json_t *tempsensors_array_obj;
+
+  struct w1_reading readings [W1_MAX_SENSORS];
+  time_t now;
+  int i, n;
+
+  int tempsensors_len;
+
+  print_log (LOG_INFO, "(%p) (cmd_GetTempSensors) processing request\n", wsi);
+
+  n = w1_engine_readings (readings, W1_MAX_SENSORS);
+  if (n < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) can't open 'w1_bus_master1' directory\n", wsi);
+      return send_error (out, "Can't open 'w1_bus_master1' directory");
+    }
+
+  tempsensors_obj = json_object();
+  tempsensors_array_obj = json_array();
+  now = time (NULL);
+
+  for (i = 0; i < n; i++)
+    {
+      json_t *tempsensor_obj;
+
+      /* not converted yet */
+      if (readings[i].timestamp == 0)
+        continue;
+
+      tempsensor_obj = json_pack ("{s:s, s:s, s:f, s:s, s:I, s:I}",
+                                  "type", readings[i].type,
+                                  "id", readings[i].id,
+                                  "temp", readings[i].temp,
+                                  "crc", readings[i].crc,
+                                  "timestamp", (json_int_t) readings[i].timestamp,
+                                  "age", (json_int_t) (now - readings[i].timestamp));
+
       json_array_append (tempsensors_array_obj, tempsensor_obj);
       json_decref (tempsensor_obj);
-      
-      fclose (fd);
     }
 
   json_object_set (tempsensors_obj, "TempSensors", tempsensors_array_obj);
@@ -548,27 +1148,13 @@ cmd_GetTempSensors (struct libwebsocket *wsi, unsigned char *buffer)
       print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) can't prepare valid JSON object\n", wsi);
       json_decref (tempsensors_array_obj);
       json_decref (tempsensors_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
+      return send_error (out, "Can't prepare valid JSON object");
     }
 
-  tempsensors_str = json_dumps (tempsensors_obj, 0);
-  if (tempsensors_str == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_GetTempSensors) can't prepare valid JSON object\n", wsi);
-      json_decref (tempsensors_array_obj);
-      json_decref (tempsensors_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
-
-  tempsensors_len = strlen (tempsensors_str);
-  memcpy (buffer, tempsensors_str, tempsensors_len);
-
-  if (opt_show_json_obj)
-    print_log (LOG_INFO, "(%p) (cmd_GetTempSensors) %s\n", wsi, tempsensors_str);
+  tempsensors_len = send_json (wsi, out, "cmd_GetTempSensors", tempsensors_obj);
 
   json_decref (tempsensors_array_obj);
   json_decref (tempsensors_obj);
-  free (tempsensors_str);
 
   return tempsensors_len;
 }
@@ -577,447 +1163,2532 @@ cmd_GetTempSensors (struct libwebsocket *wsi, unsigned char *buffer)
 /*
  * cmd_GetProcesses()
  *
+ * args: "since <seq>" (optional)
+ *
+ * Every call takes a new snapshot of the process table numbered with "Seq",
+ * unless the last one is less than PROC_SNAPSHOT_REUSE old - clients and
+ * subscriptions polling together share it, and keep their bases in the
+ * history longer. "cpu" is the share of one CPU (in %) used over the last
+ * second or more, "rss" and "swap" are in kB. A delta lists a process as
+ * changed once its cpu moved by 1% or its memory by 64 kB.
+ * A client which still holds snapshot <seq> gets only the differences
+ * between it and the new one; when <seq> is unknown or too old the whole
+ * table is sent.
+ *
  * JSON Object
  * ===========
  *
  * {
+ *   "Seq": 42,
  *   "Processes": [
  *     {
  *       "pid"  : 1,
  *       "user" : "root",
  *       "name" : "init",
- *       "state": "S (sleeping)"
+ *       "state": "S (sleeping)",
+ *       "cpu"  : 0.0,
+ *       "rss"  : 1544,
+ *       "swap" : 0
  *     },
  *     {
  *       "pid"  : 1934,
  *       "user" : "root",
  *       "name" : "rsyslogd",
- *       "state": "S (sleeping)"
+ *       "state": "S (sleeping)",
+ *       "cpu"  : 1.3,
+ *       "rss"  : 2312,
+ *       "swap" : 128
  *     },
  *     .
  *     .
  *   ]
  * }
+ *
+ * or
+ *
+ * {
+ *   "ProcessesDelta": {
+ *     "base"   : 40,
+ *     "seq"    : 42,
+ *     "added"  : [ { "pid": 2201, "user": "pi", "name": "bash", ... } ],
+ *     "removed": [ 2187 ],
+ *     "changed": [ { "pid": 1934, "user": "root", "name": "rsyslogd", ... } ]
+ *   }
+ * }
  */
-unsigned int
-cmd_GetProcesses (struct libwebsocket *wsi, unsigned char *buffer)
+static void
+proc_entry_write (struct jsonw *w, const struct proc_entry *entry)
 {
-  json_t *proc_obj;
-  json_t *proc_array_obj;
+  const char *user;
 
-  FILE *proc_pid_status;
-  DIR *proc_dir;
-  struct dirent *proc_pid_dir;
+  jsonw_object_begin (w);
+  jsonw_key (w, "pid");
+  jsonw_int (w, entry->pid);
+  if ((user = uid_to_name (entry->uid)))
+    {
+      jsonw_key (w, "user");
+      jsonw_string (w, user);
+    }
+  jsonw_key (w, "name");
+  jsonw_string (w, entry->name);
+  jsonw_key (w, "state");
+  jsonw_string (w, entry->state);
+  jsonw_key (w, "cpu");
+  jsonw_real (w, (int) (entry->cpu * 10) / 10.0);
+  jsonw_key (w, "rss");
+  jsonw_int (w, entry->rss);
+  jsonw_key (w, "swap");
+  jsonw_int (w, entry->swap);
+  jsonw_object_end (w);
+}
 
-  char filepath [PATH_MAX];
-  char fileline [1000];
-  char *ptr;
+/* the diff is walked once per array, each pass writes one kind of change */
+struct proc_delta_writer {
+  struct jsonw *w;
+  enum proc_change change;
+};
 
-  char *proc_str;
-  int proc_len;
+static void
+proc_delta_write (enum proc_change change, const struct proc_entry *entry, void *data)
+{
+  struct proc_delta_writer *dw = data;
 
-  print_log (LOG_INFO, "(%p) (cmd_GetProcesses) processing request\n", wsi);
+  if (change != dw->change)
+    return;
 
-  proc_dir = opendir ("/proc");
-  if (proc_dir == NULL)
+  if (change == PROC_REMOVED)
+    jsonw_int (dw->w, entry->pid);
+  else
+    proc_entry_write (dw->w, entry);
+}
+
+static unsigned int
+processes_write (struct libwebsocket *wsi, struct msgbuf *out, char *args, guint reuse_ms)
+{
+  static const char *const delta_keys[] = {
+    [PROC_ADDED] = "added",
+    [PROC_REMOVED] = "removed",
+    [PROC_CHANGED] = "changed",
+  };
+  struct proc_delta_writer dw;
+  struct jsonw w;
+
+  const struct proc_snapshot *snap, *base = NULL;
+  unsigned int since;
+  int i;
+
+  print_log (LOG_INFO, "(%p) (cmd_GetProcesses) processing request\n", wsi);
+
+  /* the snapshots are shared by the workers, hold them until serialized */
+  g_mutex_lock (&proc_lock);
+
+  snap = proc_history_take (proc_history, reuse_ms);
+  if (snap == NULL)
     {
+      g_mutex_unlock (&proc_lock);
       print_log (LOG_ERR, "(%p) (cmd_GetProcesses) unable to read the list of processes\n", wsi);
-      return send_error (buffer, "Unable to read the list of processes");
+      return send_error (out, "Unable to read the list of processes");
+    }
+
+  if (args && sscanf (args, " since %u", &since) == 1)
+    base = proc_history_find (proc_history, since);
+
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+
+  if (base)
+    {
+      jsonw_key (&w, "ProcessesDelta");
+      jsonw_object_begin (&w);
+      jsonw_key (&w, "base");
+      jsonw_int (&w, base->seq);
+      jsonw_key (&w, "seq");
+      jsonw_int (&w, snap->seq);
+
+      dw.w = &w;
+      for (dw.change = PROC_ADDED; dw.change <= PROC_CHANGED; dw.change++)
+        {
+          jsonw_key (&w, delta_keys[dw.change]);
+          jsonw_array_begin (&w);
+          proc_snapshot_diff (base, snap, proc_delta_write, &dw);
+          jsonw_array_end (&w);
+        }
+
+      jsonw_object_end (&w);
+    }
+  else
+    {
+      jsonw_key (&w, "Seq");
+      jsonw_int (&w, snap->seq);
+      jsonw_key (&w, "Processes");
+      jsonw_array_begin (&w);
+      for (i = 0; i < snap->n; i++)
+        proc_entry_write (&w, &snap->entries[i]);
+      jsonw_array_end (&w);
+    }
+
+  jsonw_object_end (&w);
+
+  g_mutex_unlock (&proc_lock);
+
+  return send_written (wsi, "cmd_GetProcesses", &w);
+}
+
+unsigned int
+cmd_GetProcesses (struct libwebsocket *wsi, struct per_session_data *psd,
+                  struct msgbuf *out, char *args)
+{
+  return processes_write (wsi, out, args, PROC_SNAPSHOT_REUSE);
+}
+
+
+/*
+ * cmd_GetStatistics()
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "Statistics": {
+ *      "kernel": "3.2.27+",
+ *      "uptime": "1h 16m 39s",
+ *      "serial": "00000000b62b4ab1",
+ *      "mac_addr": "a1:eb:27:13:aa:b3",
+ *      "used_space": 2.21,
+ *      "free_space": 7.23,
+ *      "ram_usage": 51,
+ *      "swap_usage": 24,
+ *      "cpu_load": "0.00 0.01 0.05",
+ *      "cpu_temp": 44,
+ *      "cpu_usage": 23,
+ *      "cpu_usage_10s": 18,
+ *      "cpu_usage_60s": 12,
+ *      "cpu_cores": [ 23 ]
+ *   }
+ * }
+ *
+ */
+bool eth_filter(const char *name)
+{
+	if (strcmp(name, "eth0") == 0)
+		return true;
+	return false;
+}
+
+bool fs_filter(const char *name)
+{
+	if (strcmp(name, "/") == 0)
+		return true;
+	return false;
+}
+
+unsigned int
+cmd_GetStatistics (struct libwebsocket *wsi, struct per_session_data *psd,
+                   struct msgbuf *out, char *args)
+{
+  struct jsonw w;
+
+  char *kernel, *uptime, *serial, *mac_addr, *cpu_load;
+  int ram_usage, swap_usage, cpu_temp, cpu_usage, cpu_usage_10s, cpu_usage_60s;
+  double used_space, free_space;
+  uint64_t sused, sfree;
+  char **arr = NULL;
+  int i, n;
+
+  print_log (LOG_INFO, "(%p) (cmd_GetStatistics) processing request\n", wsi);
+
+  g_mutex_lock (&sysinfo_lock);
+  kernel = get_kernel_version(devman);
+  uptime = get_uptime_str(devman);
+  serial = get_rpi_serial(devman);
+  n = get_netdevices(&arr, eth_filter);
+  mac_addr = NULL;
+  if (n > 0)
+    sscanf(arr[0], "%*[a-z0-9:] %ms", &mac_addr);
+  FREE_ARRAY_ELEMENTS(arr, i, n);
+  free(arr);
+  arr = NULL;
+  n = get_df(devman, &arr, fs_filter);
+  sused = sfree = 0;
+  if (n > 0)
+    sscanf(arr[0], "%*s %*s %"SCNu64" %"SCNu64, &sused, &sfree);
+  used_space = sused / 1024.0 / 1024.0;
+  free_space = sfree / 1024.0 / 1024.0;
+  FREE_ARRAY_ELEMENTS(arr, i, n);
+  free(arr);
+  ram_usage =  total_mem_usage(devman, false);
+  swap_usage =  total_mem_usage(devman, true);
+  cpu_load = get_cpuload_str(devman);
+  cpu_temp =  get_rpi_cpu_temp();
+  cpu_usage = cpu_sampler_usage (cpu_sampler, -1, 1);
+  cpu_usage_10s = cpu_sampler_usage (cpu_sampler, -1, 10);
+  cpu_usage_60s = cpu_sampler_usage (cpu_sampler, -1, 60);
+
+  /* values which couldn't be read are null */
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "Statistics");
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "kernel");
+  jsonw_string (&w, kernel);
+  jsonw_key (&w, "uptime");
+  jsonw_string (&w, uptime);
+  jsonw_key (&w, "serial");
+  jsonw_string (&w, serial);
+  jsonw_key (&w, "mac_addr");
+  jsonw_string (&w, mac_addr);
+  jsonw_key (&w, "used_space");
+  jsonw_real (&w, used_space);
+  jsonw_key (&w, "free_space");
+  jsonw_real (&w, free_space);
+  jsonw_key (&w, "ram_usage");
+  jsonw_int (&w, ram_usage);
+  jsonw_key (&w, "swap_usage");
+  jsonw_int (&w, swap_usage);
+  jsonw_key (&w, "cpu_load");
+  jsonw_string (&w, cpu_load);
+  jsonw_key (&w, "cpu_temp");
+  jsonw_int (&w, cpu_temp);
+  jsonw_key (&w, "cpu_usage");
+  jsonw_int (&w, cpu_usage);
+  jsonw_key (&w, "cpu_usage_10s");
+  jsonw_int (&w, cpu_usage_10s);
+  jsonw_key (&w, "cpu_usage_60s");
+  jsonw_int (&w, cpu_usage_60s);
+  jsonw_key (&w, "cpu_cores");
+  jsonw_array_begin (&w);
+  for (i = 0; i < cpu_sampler_ncpus (cpu_sampler); i++)
+    jsonw_int (&w, (int) cpu_sampler_usage (cpu_sampler, i, 1));
+  jsonw_array_end (&w);
+  jsonw_object_end (&w);
+  jsonw_object_end (&w);
+  g_mutex_unlock (&sysinfo_lock);
+
+  free(kernel);
+  free(uptime);
+  free(serial);
+  free(mac_addr);
+  free(cpu_load);
+  return send_written (wsi, "cmd_GetStatistics", &w);
+}
+
+
+/*
+ * stats_sample_tick()
+ *
+ * Records one sample of the statistics history.
+ */
+static gboolean
+stats_sample_tick (gpointer user_data)
+{
+  float values[STAT_METRICS];
+  uint64_t sused = 0, sfree = 0;
+  double load;
+  char **arr = NULL;
+  int i, n;
+
+  g_mutex_lock (&sysinfo_lock);
+  values[STAT_RAM] = total_mem_usage (devman, false);
+  values[STAT_SWAP] = total_mem_usage (devman, true);
+  values[STAT_CPU] = cpu_sampler_usage (cpu_sampler, -1, stats_interval);
+  n = get_df (devman, &arr, fs_filter);
+  if (n > 0)
+    sscanf (arr[0], "%*s %*s %"SCNu64" %"SCNu64, &sused, &sfree);
+  FREE_ARRAY_ELEMENTS(arr, i, n);
+  free (arr);
+  g_mutex_unlock (&sysinfo_lock);
+
+  values[STAT_CPU_TEMP] = get_rpi_cpu_temp ();
+  values[STAT_LOAD] = getloadavg (&load, 1) == 1 ? load : NAN;
+  values[STAT_DISK] = sused + sfree > 0 ? sused * 100.0 / (sused + sfree) : NAN;
+
+  /* no swap is 0 / 0, a reading which failed is negative */
+  for (i = 0; i < STAT_METRICS; i++)
+    if (!isfinite (values[i]) || values[i] < 0)
+      values[i] = NAN;
+
+  stat_history_add (stat_history, g_get_real_time () / G_USEC_PER_SEC, values);
+  return TRUE;
+}
+
+
+/*
+ * stats_sync_tick()
+ *
+ * Writes the statistics history back to its file. Samples only touch
+ * memory, this is the one place the file is written - rarely, for the
+ * sake of the SD card. Only the changed pages are written, into the page
+ * cache; nothing waits for the card in the main loop.
+ */
+static gboolean
+stats_sync_tick (gpointer user_data)
+{
+  if (stat_history_sync (stat_history) < 0)
+    print_log (LOG_ERR, "(stats_sync_tick) can't write statistics history: %s\n", g_strerror (errno));
+
+  return TRUE;
+}
+
+
+/*
+ * cmd_GetStatisticsHistory()
+ *
+ * args: "<from> <to> <maxpoints>"
+ *
+ * UNIX times, those not above 0 are relative to now - "-3600 0 60" is the
+ * last hour by the minute. Each point covers 'width' seconds from 't' and
+ * has [min, avg, max] of every metric, null if there was no sample.
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "StatisticsHistory": {
+ *     "width": 60,
+ *     "points": [
+ *       {
+ *         "t"         : 1412345640,
+ *         "ram_usage" : [ 48.2, 49.1, 51.0 ],
+ *         "swap_usage": [ 24.0, 24.0, 24.0 ],
+ *         "cpu_usage" : [ 3.0, 11.4, 67.0 ],
+ *         "cpu_temp"  : [ 44.0, 44.8, 46.0 ],
+ *         "load"      : [ 0.05, 0.11, 0.2 ],
+ *         "disk_usage": [ 23.4, 23.4, 23.4 ]
+ *       },
+ *       .
+ *       .
+ *     ]
+ *   }
+ * }
+ */
+unsigned int
+cmd_GetStatisticsHistory (struct libwebsocket *wsi, struct per_session_data *psd,
+                          struct msgbuf *out, char *args)
+{
+  static const char *const metric_keys[STAT_METRICS] = {
+    [STAT_RAM] = "ram_usage",
+    [STAT_SWAP] = "swap_usage",
+    [STAT_CPU] = "cpu_usage",
+    [STAT_CPU_TEMP] = "cpu_temp",
+    [STAT_LOAD] = "load",
+    [STAT_DISK] = "disk_usage",
+  };
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  struct stat_bucket *points;
+  struct jsonw w;
+  gint64 from, to;
+  guint maxpoints, width;
+  int i, j, n;
+
+  print_log (LOG_INFO, "(%p) (cmd_GetStatisticsHistory) processing request\n", wsi);
+
+  if (sscanf (args, "%" SCNd64 " %" SCNd64 " %u", &from, &to, &maxpoints) != 3 ||
+      maxpoints == 0 || maxpoints > STAT_MAX_POINTS)
+    return send_error (out, "Invalid arguments - usage: GetStatisticsHistory <from> <to> <maxpoints>, "
+                            "at most " G_STRINGIFY (STAT_MAX_POINTS) " points");
+
+  if (from <= 0)
+    from += now;
+  if (to <= 0)
+    to += now;
+
+  points = g_new (struct stat_bucket, maxpoints);
+  n = stat_history_query (stat_history, from, to, maxpoints, points, &width);
+
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "StatisticsHistory");
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "width");
+  jsonw_int (&w, n > 0 ? width : 0);
+  jsonw_key (&w, "points");
+  jsonw_array_begin (&w);
+
+  for (i = 0; i < n; i++)
+    {
+      jsonw_object_begin (&w);
+      jsonw_key (&w, "t");
+      jsonw_int (&w, points[i].start);
+
+      for (j = 0; j < STAT_METRICS; j++)
+        {
+          const struct stat_agg *agg = &points[i].v[j];
+
+          jsonw_key (&w, metric_keys[j]);
+          if (agg->n == 0)
+            {
+              jsonw_null (&w);
+              continue;
+            }
+
+          jsonw_array_begin (&w);
+          jsonw_real_digits (&w, agg->min, 4);
+          jsonw_real_digits (&w, agg->sum / agg->n, 4);
+          jsonw_real_digits (&w, agg->max, 4);
+          jsonw_array_end (&w);
+        }
+
+      jsonw_object_end (&w);
+    }
+
+  jsonw_array_end (&w);
+  jsonw_object_end (&w);
+  jsonw_object_end (&w);
+
+  g_free (points);
+  return send_written (wsi, "cmd_GetStatisticsHistory", &w);
+}
+
+
+/*
+ * send_ir()
+ *
+ * Sends 'directive' for every code in args: "<remote> <code> [<code> ...]".
+ */
+static unsigned int
+send_ir (struct libwebsocket *wsi, struct msgbuf *out, const char *cmd,
+         enum lirc_directive directive, char *args)
+{
+  char *remote, *code, *saveptr;
+  char err [128];
+  gchar *error;
+  unsigned int len;
+
+  /* run by a worker - no strtok() */
+  remote = strtok_r (args, " ", &saveptr);
+  code = strtok_r (NULL, " ", &saveptr);
+
+  for (; remote && code; code = strtok_r (NULL, " ", &saveptr))
+    {
+      if (lirc_send (lirc, directive, remote, code, 0, err, sizeof (err)) == 0)
+        continue;
+
+      print_log (LOG_ERR, "(%p) (%s) can't send %s %s: %s\n", wsi, cmd, remote, code, err);
+      error = g_strdup_printf ("Can't send signal - %s", err);
+      len = send_error (out, error);
+      g_free (error);
+      return len;
+    }
+
+  return 0;
+}
+
+
+/*
+ * cmd_SendIR()
+ *
+ * args: "<remote> <code> [<code> ...]"
+ */
+unsigned int
+cmd_SendIR (struct libwebsocket *wsi, struct per_session_data *psd,
+            struct msgbuf *out, char *args)
+{
+  print_log (LOG_INFO, "(%p) (cmd_SendIR) processing request\n", wsi);
+
+  return send_ir (wsi, out, "cmd_SendIR", LIRC_SEND_ONCE, args);
+}
+
+
+/*
+ * cmd_SendIRStart()
+ *
+ * args: "<remote> <code>" - repeats the code until SendIRStop
+ */
+unsigned int
+cmd_SendIRStart (struct libwebsocket *wsi, struct per_session_data *psd,
+                 struct msgbuf *out, char *args)
+{
+  print_log (LOG_INFO, "(%p) (cmd_SendIRStart) processing request\n", wsi);
+
+  return send_ir (wsi, out, "cmd_SendIRStart", LIRC_SEND_START, args);
+}
+
+
+/*
+ * cmd_SendIRStop()
+ *
+ * args: "<remote> <code>"
+ */
+unsigned int
+cmd_SendIRStop (struct libwebsocket *wsi, struct per_session_data *psd,
+                struct msgbuf *out, char *args)
+{
+  print_log (LOG_INFO, "(%p) (cmd_SendIRStop) processing request\n", wsi);
+
+  return send_ir (wsi, out, "cmd_SendIRStop", LIRC_SEND_STOP, args);
+}
+
+
+/*
+ * IR sequences
+ *
+ * A sequence is run from the main loop: a timerfd waits for the deadline
+ * of each step and the step alone is sent by the IR sender thread, so a
+ * long macro holds no worker while it waits - lircd takes one command at
+ * a time anyway. The request is answered once the sequence is over.
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "IRSequence": [
+ *     {
+ *       "remote": "tv",
+ *       "code"  : "KEY_POWER",
+ *       "status": "sent"
+ *     },
+ *     {
+ *       "remote": "amp",
+ *       "code"  : "KEY_POWER",
+ *       "status": "failed",
+ *       "error" : "unknown remote: \"amp\""
+ *     },
+ *     {
+ *       "remote": "amp",
+ *       "code"  : "KEY_VOLUMEUP",
+ *       "status": "skipped"
+ *     }
+ *   ],
+ *   "Macro": "movie"
+ * }
+ *
+ * "Macro" is there only for RunIRMacro.
+ */
+struct ir_run {
+  struct request *req;
+  const char *cmd;                           /* for the log */
+  gchar *macro;                              /* RunIRMacro, NULL otherwise */
+  struct ir_sequence *seq;
+  guint step;                                /* the one being sent or waited for */
+  struct timespec deadline;                  /* CLOCK_MONOTONIC, of that step */
+  int timer_fd;
+  guint timer_id;
+};
+
+
+/*
+ * ir_run_finish()
+ *
+ * Answers the request with the status of every step.
+ */
+static void
+ir_run_finish (struct ir_run *run)
+{
+  static const char *status[] = {
+    [IR_STEP_SKIPPED] = "skipped",
+    [IR_STEP_SENT] = "sent",
+    [IR_STEP_FAILED] = "failed",
+  };
+  struct request *req = run->req;
+  json_t *seq_obj;
+  json_t *steps_array_obj;
+  unsigned int seq_len;
+  guint i;
+
+  if (run->step < run->seq->n)
+    print_log (LOG_ERR, "(%p) (%s) sequence stopped at step %u: %s\n", req->wsi, run->cmd,
+               run->step + 1, run->seq->steps[run->step].error);
+
+  steps_array_obj = json_array();
+  for (i = 0; i < run->seq->n; i++)
+    {
+      struct ir_step *step = &run->seq->steps[i];
+      json_t *step_obj;
+
+      step_obj = json_pack ("{s:s, s:s, s:s}",
+                            "remote", step->remote,
+                            "code", step->code,
+                            "status", status[step->status]);
+      if (step->status == IR_STEP_FAILED)
+        json_object_set_new (step_obj, "error", json_string (step->error));
+
+      json_array_append_new (steps_array_obj, step_obj);
+    }
+
+  seq_obj = json_pack ("{s:o}", "IRSequence", steps_array_obj);
+  if (seq_obj != NULL && run->macro)
+    json_object_set_new (seq_obj, "Macro", json_string (run->macro));
+
+  if (seq_obj == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (%s) can't prepare valid JSON object\n", req->wsi, run->cmd);
+      seq_len = send_error (req->out, "Can't prepare valid JSON object");
+    }
+  else
+    seq_len = send_json (req->wsi, req->out, run->cmd, seq_obj);
+
+  json_decref (seq_obj);
+
+  if (run->timer_id > 0)
+    g_source_remove (run->timer_id);
+  if (run->timer_fd >= 0)
+    close (run->timer_fd);
+  ir_sequence_free (run->seq);
+  g_free (run->macro);
+  g_free (run);
+
+  request_finish (req, seq_len);
+}
+
+
+/*
+ * ir_run_timer()
+ *
+ * The deadline of the next step has come.
+ */
+static gboolean
+ir_run_timer (gint fd, GIOCondition condition, gpointer user_data)
+{
+  struct ir_run *run = user_data;
+  guint64 expirations;
+
+  if (read (fd, &expirations, sizeof (expirations)) < 0 && errno == EAGAIN)
+    return TRUE;
+
+  g_thread_pool_push (ir_senders, run, NULL);
+  return TRUE;
+}
+
+
+/*
+ * ir_run_sent()
+ *
+ * Called in the main loop once the sender is done with a step.
+ */
+static gboolean
+ir_run_sent (gpointer user_data)
+{
+  struct ir_run *run = user_data;
+  struct ir_step *step = &run->seq->steps[run->step];
+  struct itimerspec its;
+
+  if (step->status != IR_STEP_SENT || ++run->step == run->seq->n)
+    {
+      ir_run_finish (run);
+      return FALSE;
+    }
+
+  /* from the deadline of the step, not from when lircd was done with it */
+  run->deadline.tv_sec += step->delay / 1000;
+  run->deadline.tv_nsec += (step->delay % 1000) * 1000000L;
+  if (run->deadline.tv_nsec >= 1000000000L)
+    {
+      run->deadline.tv_sec++;
+      run->deadline.tv_nsec -= 1000000000L;
+    }
+
+  /* a deadline already passed expires at once */
+  memset (&its, 0, sizeof (its));
+  its.it_value = run->deadline;
+  if (timerfd_settime (run->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    {
+      step = &run->seq->steps[run->step];
+      g_snprintf (step->error, sizeof (step->error), "timer: %s", g_strerror (errno));
+      step->status = IR_STEP_FAILED;
+      ir_run_finish (run);
     }
 
-  proc_obj = json_object();
-  proc_array_obj = json_array();
+  return FALSE;
+}
+
+
+/*
+ * ir_sender()
+ *
+ * IR sender thread - sends the current step of a run.
+ */
+static void
+ir_sender (gpointer data, gpointer user_data)
+{
+  struct ir_run *run = data;
+
+  ir_step_send (&run->seq->steps[run->step], lirc);
+  g_main_context_invoke (NULL, ir_run_sent, run);
+}
+
+
+/*
+ * ir_run_start()
+ *
+ * Sends the first step right away. The request is answered once the
+ * sequence is over, or now if it can't be run.
+ */
+static void
+ir_run_start (struct request *req, const char *cmd, const char *text, const char *macro)
+{
+  struct ir_run *run;
+  struct ir_sequence *seq;
+
+  seq = ir_sequence_parse (text);
+  if (seq == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (%s) invalid IR sequence\n", req->wsi, cmd);
+      request_finish (req, send_error (req->out, "Invalid IR sequence - usage: <remote> <code> [<repeat> [<delay>]]; ..."));
+      return;
+    }
+
+  run = g_new0 (struct ir_run, 1);
+  run->req = req;
+  run->cmd = cmd;
+  run->macro = g_strdup (macro);
+  run->seq = seq;
+  run->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (run->timer_fd < 0)
+    {
+      print_log (LOG_ERR, "(%p) (%s) can't create sequence timer\n", req->wsi, cmd);
+      ir_sequence_free (seq);
+      g_free (run->macro);
+      g_free (run);
+      request_finish (req, send_error (req->out, "Can't send IR sequence - please check server's log"));
+      return;
+    }
+
+  run->timer_id = g_unix_fd_add (run->timer_fd, G_IO_IN, ir_run_timer, run);
+  clock_gettime (CLOCK_MONOTONIC, &run->deadline);
+  g_thread_pool_push (ir_senders, run, NULL);
+}
+
+
+/*
+ * cmd_SendIRSequence()
+ *
+ * args: "<remote> <code> [<repeat> [<delay>]]; ..." - see irseq.h
+ */
+void
+cmd_SendIRSequence (struct request *req, char *args)
+{
+  print_log (LOG_INFO, "(%p) (cmd_SendIRSequence) processing request\n", req->wsi);
+
+  ir_run_start (req, "cmd_SendIRSequence", args, NULL);
+}
+
+
+/*
+ * cmd_RunIRMacro()
+ *
+ * args: "<macro>"
+ */
+void
+cmd_RunIRMacro (struct request *req, char *args)
+{
+  gchar *text;
+
+  print_log (LOG_INFO, "(%p) (cmd_RunIRMacro) processing request\n", req->wsi);
+
+  g_strstrip (args);
+  text = ir_macros_lookup (ir_macros, args);
+  if (text == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_RunIRMacro) unknown IR macro '%s'\n", req->wsi, args);
+      request_finish (req, send_error (req->out, "Unknown IR macro"));
+      return;
+    }
+
+  ir_run_start (req, "cmd_RunIRMacro", text, args);
+  g_free (text);
+}
+
+
+/*
+ * cmd_GetIRMacros()
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "IRMacros": {
+ *     "movie": "tv KEY_POWER 0 3000; amp KEY_POWER 0 1000; amp KEY_VIDEO1",
+ *     "mute" : "amp KEY_MUTE",
+ *     .
+ *     .
+ *   }
+ * }
+ */
+unsigned int
+cmd_GetIRMacros (struct libwebsocket *wsi, struct per_session_data *psd,
+                 struct msgbuf *out, char *args)
+{
+  json_t *macros_obj;
+  json_t *macros_map_obj;
+  gchar **names;
+  gchar *text;
+  int macros_len;
+  guint i;
+
+  print_log (LOG_INFO, "(%p) (cmd_GetIRMacros) processing request\n", wsi);
+
+  macros_map_obj = json_object();
+  names = ir_macros_list (ir_macros);
+
+  for (i = 0; names[i]; i++)
+    {
+      /* may be gone already, deleted by another client */
+      text = ir_macros_lookup (ir_macros, names[i]);
+      if (text)
+        json_object_set_new (macros_map_obj, names[i], json_string (text));
+      g_free (text);
+    }
+
+  g_strfreev (names);
+
+  macros_obj = json_pack ("{s:o}", "IRMacros", macros_map_obj);
+  if (macros_obj == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_GetIRMacros) can't prepare valid JSON object\n", wsi);
+      return send_error (out, "Can't prepare valid JSON object");
+    }
+
+  macros_len = send_json (wsi, out, "cmd_GetIRMacros", macros_obj);
+
+  json_decref (macros_obj);
+  return macros_len;
+}
+
+
+/*
+ * cmd_DefineIRMacro()
+ *
+ * args: "<macro> <remote> <code> [<repeat> [<delay>]]; ..."
+ *
+ * Adds or replaces the macro, answers like GetIRMacros.
+ */
+unsigned int
+cmd_DefineIRMacro (struct libwebsocket *wsi, struct per_session_data *psd,
+                   struct msgbuf *out, char *args)
+{
+  char *name, *text;
+
+  print_log (LOG_INFO, "(%p) (cmd_DefineIRMacro) processing request\n", wsi);
+
+  name = args + strspn (args, " ");
+  text = strchr (name, ' ');
+  if (text == NULL)
+    return send_error (out, "Invalid macro name or IR sequence");
+  *text++ = '\0';
+
+  if (ir_macros_define (ir_macros, name, g_strstrip (text)) < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_DefineIRMacro) can't define macro '%s': %s\n", wsi, name, g_strerror (errno));
+      if (errno == EINVAL)
+        return send_error (out, "Invalid macro name or IR sequence");
+      return send_error (out, "Can't save IR macros - please check server's log");
+    }
+
+  return cmd_GetIRMacros (wsi, psd, out, NULL);
+}
+
+
+/*
+ * cmd_DeleteIRMacro()
+ *
+ * args: "<macro>"
+ */
+unsigned int
+cmd_DeleteIRMacro (struct libwebsocket *wsi, struct per_session_data *psd,
+                   struct msgbuf *out, char *args)
+{
+  print_log (LOG_INFO, "(%p) (cmd_DeleteIRMacro) processing request\n", wsi);
+
+  g_strstrip (args);
+  if (ir_macros_delete (ir_macros, args) < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_DeleteIRMacro) can't delete macro '%s': %s\n", wsi, args, g_strerror (errno));
+      if (errno == ENOENT)
+        return send_error (out, "Unknown IR macro");
+      return send_error (out, "Can't save IR macros - please check server's log");
+    }
+
+  return cmd_GetIRMacros (wsi, psd, out, NULL);
+}
+
+
+/*
+ * cmd_SetGPIO()
+ */
+unsigned int
+cmd_SetGPIO (struct libwebsocket *wsi, struct per_session_data *psd,
+             struct msgbuf *out, char *args)
+{
+  struct gpio_pin *pin;
+  char *gpio_num;
+  char *gpio_act;
+
+  print_log (LOG_INFO, "(%p) (cmd_SetGPIO) processing request\n", wsi);
+
+  /* TODO - strcpy? */
+  gpio_num = strtok (args, " ");
+  gpio_act = strtok (NULL, " ");
+
+  if (gpio_num == NULL || gpio_act == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unsupported value - please report a bug\n", wsi);
+      return send_error (out, "Unsupported value - please report a bug");
+    }
+
+  pin = gpio_table_find (gpio_table, atoi (gpio_num));
+
+  if ((strcmp(gpio_act, "1") == 0) || (strcmp(gpio_act, "0") == 0))
+    {
+      if (!pin || gpio_write_value (pin, gpio_act[0] == '1') < 0)
+        {
+          print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unable to change GPIO value\n", wsi);
+          gpio_table->last_scan = 0;
+          return send_error (out, "Unable to change GPIO value");
+        }
+    }
+  else if ((strcmp(gpio_act, "in") == 0) || (strcmp(gpio_act, "out") == 0))
+    {
+      if (!pin || gpio_write_direction (pin, gpio_act) < 0)
+        {
+          print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unable to change GPIO direction\n", wsi);
+          gpio_table->last_scan = 0;
+          return send_error (out, "Unable to change GPIO direction");
+        }
+    }
+  else
+    {
+      print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unsupported value - please report a bug\n", wsi);
+      return send_error (out, "Unsupported value - please report a bug");
+    }
+
+  respcache_invalidate (response_cache, "GetGPIO");
+  return cmd_GetGPIO (wsi, psd, out, NULL);
+}
+
+
+/*
+ * cmd_KillProcess()
+ *
+ * args: "<pid> [since <seq>]"
+ */
+unsigned int
+cmd_KillProcess (struct libwebsocket *wsi, struct per_session_data *psd,
+                 struct msgbuf *out, char *pid_str)
+{
+  unsigned int pid;
+
+  print_log (LOG_INFO, "(%p) (cmd_KillProcess) processing request\n", wsi);
+
+  if (pid_str)
+    {
+      pid = atoi (pid_str);
+      if (pid)
+        {
+          gint ret;
+
+          ret = kill (pid, SIGKILL);
+          if (ret < 0)
+            goto error;
+          print_log (LOG_INFO, "(%p) (cmd_KillProcess) send SIGKILL to PID %d\n", wsi, (int) pid);
+        }
+      else
+        {
+          goto error;
+        }
+    }
+  else
+    {
+      goto error;
+    }
+  
+  respcache_invalidate (response_cache, "GetProcesses");
+
+  /* "<pid> since <seq>" asks for a delta of the process list - a fresh one */
+  return processes_write (wsi, out, strchr (pid_str, ' '), 0);
+
+error:
+  print_log (LOG_ERR, "(%p) (cmd_KillProcess) Can't kill selected process\n", wsi);
+  return send_error (out, "Can't kill selected process");
+}
+
+
+/*
+ * Response cache
+ *
+ * Responses of the read-only commands are kept for a short while, so
+ * clients polling the same thing are answered with a copy of the last
+ * response instead of another scan. Commands changing the state drop the
+ * affected entries.
+ */
+/*
+ * response_is_error()
+ *
+ * Errors are the only responses starting with the "Error" key - key 0 in
+ * CBOR. send_error() writes them all.
+ */
+static gboolean
+response_is_error (enum msgbuf_encoding encoding, const unsigned char *response, size_t len)
+{
+  static const struct {
+    const char *head;
+    size_t len;
+  } error_heads[MSGBUF_ENCODINGS] = {
+    [MSGBUF_JSON] = { "{\"Error\"", 8 },
+    [MSGBUF_CBOR] = { "\xbf\x00", 2 },      /* indefinite map, key 0 */
+  };
+
+  return len >= error_heads[encoding].len &&
+         memcmp (response, error_heads[encoding].head, error_heads[encoding].len) == 0;
+}
+
+
+/*
+ * response_cache_store()
+ *
+ * Caches 'msg' if it is a successful response of a cacheable command,
+ * computed since the last write which invalidated it.
+ */
+static void
+response_cache_store (const struct command *command, const char *args, struct msgbuf *msg,
+                      guint generation)
+{
+  if (!(command->flags & CMD_CACHEABLE) || msg->len == 0 ||
+      response_is_error (msg->encoding, msgbuf_payload (msg), msg->len))
+    return;
+
+  respcache_store (response_cache, command->name, args, msg, command->ttl, generation);
+}
+
+
+/*
+ * Subscriptions
+ *
+ * Every subscribable command has a single timer running at the shortest
+ * interval requested by its subscribers. Each tick computes one snapshot
+ * and marks it pending for every subscriber whose own interval has elapsed,
+ * so N dashboards cost one scan instead of N. Snapshots of blocking
+ * commands are computed by a worker and published when it is done. There
+ * is one snapshot per encoding the subscribers use.
+ */
+struct subscription {
+  const gchar *cmd;
+  guint interval;
+  guint timer_id;
+  gboolean refreshing[MSGBUF_ENCODINGS];     /* snapshot on a worker */
+  GSList *sessions;
+};
+
+static struct subscription subscriptions [SUBSCRIPTION_COUNT] = {
+  { "GetGPIO" },
+  { "GetTempSensors" },
+  { "GetProcesses" },
+  { "GetStatistics" },
+};
+
+
+/*
+ * subscription_publish()
+ *
+ * Hands 'snapshot' to the subscribers of its encoding which are due.
+ */
+static void
+subscription_publish (struct subscription *sub, struct msgbuf *snapshot)
+{
+  guint idx = sub - subscriptions;
+  gint64 now = g_get_monotonic_time () / 1000;
+  GSList *l;
+
+  for (l = sub->sessions; l; l = l->next)
+    {
+      struct per_session_data *psd = l->data;
+
+      if (psd->encoding != snapshot->encoding || now < psd->sub_next[idx])
+        continue;
+
+      psd->sub_next[idx] = now + psd->sub_interval[idx];
+      session_enqueue (psd, snapshot, OUT_SUBSCRIPTION (idx));
+    }
+}
+
+
+/*
+ * subscription_refreshed()
+ */
+static void
+subscription_refreshed (struct request *req)
+{
+  struct subscription *sub = req->data;
+
+  sub->refreshing[req->out->encoding] = FALSE;
+  subscription_publish (sub, req->out);
+}
+
+
+/*
+ * subscription_refresh()
+ */
+static void
+subscription_refresh (struct subscription *sub, enum msgbuf_encoding encoding)
+{
+  static char no_args[] = "";
+  struct msgbuf *snapshot;
+  struct request *req;
+
+  /* shared with the response cache, no copy either way */
+  snapshot = respcache_lookup (response_cache, sub->cmd, no_args, encoding);
+  if (snapshot != NULL)
+    {
+      subscription_publish (sub, snapshot);
+      msgbuf_unref (snapshot);
+      return;
+    }
+
+  req = request_new (NULL, NULL, encoding);
+  if (req == NULL)
+    return;
+
+  req->cmd_str = sub->cmd;
+  req->args_str = no_args;
+  req->count = 1;
+  req->done = subscription_refreshed;
+  req->data = sub;
+
+  sub->refreshing[encoding] = TRUE;
+  request_run (req);
+}
+
+
+/*
+ * subscription_tick()
+ */
+static gboolean
+subscription_tick (gpointer user_data)
+{
+  struct subscription *sub = user_data;
+  guint idx = sub - subscriptions;
+  gint64 now = g_get_monotonic_time () / 1000;
+  gboolean due[MSGBUF_ENCODINGS] = { FALSE };
+  GSList *l;
+  guint i;
+
+  for (l = sub->sessions; l; l = l->next)
+    {
+      struct per_session_data *psd = l->data;
+
+      if (now >= psd->sub_next[idx])
+        due[psd->encoding] = TRUE;
+    }
+
+  for (i = 0; i < MSGBUF_ENCODINGS; i++)
+    if (due[i] && !sub->refreshing[i])
+      subscription_refresh (sub, i);
+
+  return TRUE;
+}
+
+
+/*
+ * subscription_reschedule()
+ */
+static void
+subscription_reschedule (struct subscription *sub)
+{
+  guint idx = sub - subscriptions;
+  guint interval = 0;
+  GSList *l;
+
+  for (l = sub->sessions; l; l = l->next)
+    {
+      struct per_session_data *psd = l->data;
+
+      if (interval == 0 || psd->sub_interval[idx] < interval)
+        interval = psd->sub_interval[idx];
+    }
+
+  if (interval == sub->interval)
+    return;
+
+  if (sub->timer_id > 0)
+    g_source_remove (sub->timer_id);
+
+  sub->timer_id = interval ? g_timeout_add (interval, subscription_tick, sub) : 0;
+  sub->interval = interval;
+}
+
+
+/*
+ * subscription_find()
+ */
+static struct subscription *
+subscription_find (const char *cmd)
+{
+  guint i;
+
+  for (i = 0; i < SUBSCRIPTION_COUNT; i++)
+    if (strcmp (subscriptions[i].cmd, cmd) == 0)
+      return &subscriptions[i];
+
+  return NULL;
+}
+
+
+/*
+ * subscription_drop()
+ */
+static void
+subscription_drop (struct per_session_data *psd, struct subscription *sub)
+{
+  guint idx = sub - subscriptions;
+
+  if (psd->sub_interval[idx] == 0)
+    return;
+
+  psd->sub_interval[idx] = 0;
+  session_drop (psd, OUT_SUBSCRIPTION (idx));
+  sub->sessions = g_slist_remove (sub->sessions, psd);
+  subscription_reschedule (sub);
+}
+
+
+/*
+ * cmd_Subscribe()
+ *
+ * args: "<command> [interval in ms]"
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "Subscribed": {
+ *     "cmd"     : "GetStatistics",
+ *     "interval": 1000
+ *   }
+ * }
+ *
+ * Snapshots are pushed later as regular responses of <command>.
+ */
+unsigned int
+cmd_Subscribe (struct libwebsocket *wsi, struct per_session_data *psd,
+               struct msgbuf *out, char *args)
+{
+  struct subscription *sub;
+  json_t *sub_obj;
+  int sub_len;
+  char cmd [64];
+  guint interval = 1000;
+  guint idx;
+
+  print_log (LOG_INFO, "(%p) (cmd_Subscribe) processing request\n", wsi);
+
+  if (sscanf (args, "%63s %u", cmd, &interval) < 1 ||
+      (sub = subscription_find (cmd)) == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_Subscribe) not supported subscription\n", wsi);
+      return send_error (out, "Not supported subscription");
+    }
+
+  if (interval < MIN_SUBSCRIPTION_INTERVAL)
+    interval = MIN_SUBSCRIPTION_INTERVAL;
+
+  idx = sub - subscriptions;
+  if (psd->sub_interval[idx] == 0)
+    sub->sessions = g_slist_prepend (sub->sessions, psd);
+
+  psd->sub_interval[idx] = interval;
+  psd->sub_next[idx] = 0;
+  subscription_reschedule (sub);
+
+  sub_obj = json_pack ("{s:{s:s, s:i}}", "Subscribed", "cmd", sub->cmd, "interval", interval);
+  sub_len = send_json (wsi, out, "cmd_Subscribe", sub_obj);
+
+  json_decref (sub_obj);
+  return sub_len;
+}
+
+
+/*
+ * cmd_Unsubscribe()
+ *
+ * args: "<command>"
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "Unsubscribed": "GetStatistics"
+ * }
+ */
+unsigned int
+cmd_Unsubscribe (struct libwebsocket *wsi, struct per_session_data *psd,
+                 struct msgbuf *out, char *args)
+{
+  struct subscription *sub;
+  json_t *sub_obj;
+  int sub_len;
+
+  print_log (LOG_INFO, "(%p) (cmd_Unsubscribe) processing request\n", wsi);
+
+  sub = subscription_find (args);
+  if (sub == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_Unsubscribe) not supported subscription\n", wsi);
+      return send_error (out, "Not supported subscription");
+    }
+
+  subscription_drop (psd, sub);
+
+  sub_obj = json_pack ("{s:s}", "Unsubscribed", sub->cmd);
+  sub_len = send_json (wsi, out, "cmd_Unsubscribe", sub_obj);
+
+  json_decref (sub_obj);
+  return sub_len;
+}
+
+
+/*
+ * GPIO edge events
+ *
+ * Each watched pin has one 'value' descriptor in the main loop, shared by
+ * all sessions watching it. Edges are pushed right away as:
+ *
+ * {
+ *   "GPIOEvent": {
+ *     "gpio"     : 17,
+ *     "value"    : 1,
+ *     "timestamp": 1234567890    (CLOCK_MONOTONIC, microseconds)
+ *   }
+ * }
+ *
+ * A pin which can't be read any more - unexported meanwhile - is dropped
+ * for all its sessions, they get "error" in place of "value" once.
+ */
+struct gpio_watcher {
+  struct gpio_watch watch;
+  guint source_id;
+  GSList *sessions;
+};
+
+
+struct gpio_event {
+  int gpio;
+  int value;                                 /* -1 if the pin is gone */
+  gint64 timestamp;
+};
+
+#define GPIO_GONE_ERROR "GPIO is no longer available"
+
+
+/*
+ * gpio_event_build()
+ *
+ * Broadcast builder. Edges come fast, the JSON text is printed rather
+ * than built.
+ */
+static struct msgbuf *
+gpio_event_build (enum msgbuf_encoding encoding, gpointer data)
+{
+  const struct gpio_event *edge = data;
+  struct msgbuf *event;
+  char event_str [128];
+  json_t *event_obj;
+  int len;
+
+  event = msgbuf_new (sizeof (event_str));
+  if (event == NULL)
+    return NULL;
+  event->encoding = encoding;
+
+  if (encoding == MSGBUF_JSON && edge->value >= 0)
+    {
+      len = snprintf (event_str, sizeof (event_str),
+                      "{\"GPIOEvent\":{\"gpio\":%d,\"value\":%d,\"timestamp\":%" PRId64 "}}",
+                      edge->gpio, edge->value, (int64_t) edge->timestamp);
+      msgbuf_append (event, event_str, len);
+      return event;
+    }
+
+  if (edge->value < 0)
+    event_obj = json_pack ("{s:{s:i, s:s, s:I}}", "GPIOEvent", "gpio", edge->gpio, "error", GPIO_GONE_ERROR,
+                           "timestamp", (json_int_t) edge->timestamp);
+  else
+    event_obj = json_pack ("{s:{s:i, s:i, s:I}}", "GPIOEvent", "gpio", edge->gpio, "value", edge->value,
+                           "timestamp", (json_int_t) edge->timestamp);
+  len = msgbuf_append_json (event, event_obj);
+  json_decref (event_obj);
+
+  if (len < 0)
+    {
+      msgbuf_unref (event);
+      return NULL;
+    }
+
+  return event;
+}
+
+
+/*
+ * gpio_watcher_free()
+ */
+static void
+gpio_watcher_free (struct gpio_watcher *watcher)
+{
+  if (watcher->source_id > 0)
+    g_source_remove (watcher->source_id);
+  g_hash_table_remove (gpio_watchers, GINT_TO_POINTER (watcher->watch.gpio));
+  gpio_watch_close (&watcher->watch);
+  g_slist_free (watcher->sessions);
+  g_free (watcher);
+}
+
+
+/*
+ * gpio_edge_callback()
+ *
+ * sysfs reports every edge as POLLPRI | POLLERR, only a failed read tells
+ * a pin which is gone - it would otherwise stay ready forever.
+ */
+static gboolean
+gpio_edge_callback (GIOChannel *channel, GIOCondition condition, gpointer user_data)
+{
+  struct gpio_watcher *watcher = user_data;
+  struct gpio_event edge = { watcher->watch.gpio, -1, g_get_monotonic_time () };
+  struct broadcast event = { gpio_event_build, &edge, OUT_EVENT };
+  gboolean gone;
+  GSList *l;
+
+  edge.value = gpio_watch_read (&watcher->watch);
+  if (edge.value < 0 && errno == EAGAIN)
+    return TRUE;
+
+  gone = edge.value < 0;
+  if (gone)
+    print_log (LOG_ERR, "(gpio_edge_callback) GPIO %d can't be read any more, dropping its watch\n",
+               watcher->watch.gpio);
+
+  for (l = watcher->sessions; l; l = l->next)
+    broadcast_send (&event, l->data);
+  broadcast_finish (&event);
+
+  if (!gone)
+    return TRUE;
+
+  /* the source goes away with this FALSE */
+  watcher->source_id = 0;
+  gpio_watcher_free (watcher);
+  return FALSE;
+}
+
+
+/*
+ * gpio_watcher_add()
+ */
+static gboolean
+gpio_watcher_add (struct per_session_data *psd, int gpio)
+{
+  struct gpio_watcher *watcher;
+  GIOChannel *channel;
+
+  watcher = g_hash_table_lookup (gpio_watchers, GINT_TO_POINTER (gpio));
+  if (watcher == NULL)
+    {
+      watcher = g_new0 (struct gpio_watcher, 1);
+      if (gpio_watch_open (&watcher->watch, gpio, "both") < 0)
+        {
+          g_free (watcher);
+          return FALSE;
+        }
+
+      channel = g_io_channel_unix_new (watcher->watch.fd);
+      watcher->source_id = g_io_add_watch (channel,
+                                           G_IO_PRI | G_IO_ERR | G_IO_HUP,
+                                           gpio_edge_callback, watcher);
+      g_io_channel_unref (channel);
+      g_hash_table_insert (gpio_watchers, GINT_TO_POINTER (gpio), watcher);
+    }
+
+  if (!g_slist_find (watcher->sessions, psd))
+    watcher->sessions = g_slist_prepend (watcher->sessions, psd);
+
+  return TRUE;
+}
+
+
+/*
+ * gpio_watcher_remove()
+ */
+static void
+gpio_watcher_remove (struct per_session_data *psd, struct gpio_watcher *watcher)
+{
+  watcher->sessions = g_slist_remove (watcher->sessions, psd);
+  if (watcher->sessions == NULL)
+    gpio_watcher_free (watcher);
+}
+
+
+/*
+ * gpio_unwatch_all()
+ */
+static void
+gpio_unwatch_all (struct per_session_data *psd)
+{
+  GHashTableIter iter;
+  gpointer value;
+  GSList *watched = NULL, *l;
+
+  g_hash_table_iter_init (&iter, gpio_watchers);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    if (g_slist_find (((struct gpio_watcher *) value)->sessions, psd))
+      watched = g_slist_prepend (watched, value);
+
+  for (l = watched; l; l = l->next)
+    gpio_watcher_remove (psd, l->data);
+
+  g_slist_free (watched);
+}
+
+
+/*
+ * gpio_watched_json()
+ */
+static unsigned int
+gpio_watched_json (struct libwebsocket *wsi, struct per_session_data *psd,
+                   struct msgbuf *out, const char *cmd)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  json_t *watch_obj, *watch_array_obj;
+  char name [32];
+  int watch_len;
+
+  watch_array_obj = json_array ();
+  g_hash_table_iter_init (&iter, gpio_watchers);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    if (g_slist_find (((struct gpio_watcher *) value)->sessions, psd))
+      json_array_append_new (watch_array_obj, json_integer (GPOINTER_TO_INT (key)));
+
+  watch_obj = json_pack ("{s:o}", cmd, watch_array_obj);
+  snprintf (name, sizeof (name), "cmd_%s", cmd);
+  watch_len = send_json (wsi, out, name, watch_obj);
+
+  json_decref (watch_obj);
+  return watch_len;
+}
+
+
+/*
+ * cmd_WatchGPIO()
+ *
+ * args: "<gpio> [<gpio> ...]"
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "WatchGPIO": [ 17, 27 ]     (all pins watched by the session)
+ * }
+ */
+unsigned int
+cmd_WatchGPIO (struct libwebsocket *wsi, struct per_session_data *psd,
+               struct msgbuf *out, char *args)
+{
+  struct gpio_watcher *watcher;
+  char *gpio_num, *saveptr;
+  GSList *added = NULL, *l;
+  int gpio;
+
+  print_log (LOG_INFO, "(%p) (cmd_WatchGPIO) processing request\n", wsi);
+
+  for (gpio_num = strtok_r (args, " ", &saveptr); gpio_num; gpio_num = strtok_r (NULL, " ", &saveptr))
+    {
+      gpio = atoi (gpio_num);
+      watcher = g_hash_table_lookup (gpio_watchers, GINT_TO_POINTER (gpio));
+      if (watcher && g_slist_find (watcher->sessions, psd))
+        continue;
+
+      if (!gpio_watcher_add (psd, gpio))
+        {
+          /* all or nothing - drop the pins added so far */
+          for (l = added; l; l = l->next)
+            if ((watcher = g_hash_table_lookup (gpio_watchers, l->data)))
+              gpio_watcher_remove (psd, watcher);
+          g_slist_free (added);
+
+          print_log (LOG_ERR, "(%p) (cmd_WatchGPIO) Unable to watch GPIO %s\n", wsi, gpio_num);
+          return send_error (out, "Unable to watch GPIO");
+        }
+
+      added = g_slist_prepend (added, GINT_TO_POINTER (gpio));
+    }
+
+  g_slist_free (added);
+  return gpio_watched_json (wsi, psd, out, "WatchGPIO");
+}
+
+
+/*
+ * cmd_UnwatchGPIO()
+ *
+ * args: "<gpio> [<gpio> ...]" or "" for all pins
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "UnwatchGPIO": [ 27 ]       (pins still watched by the session)
+ * }
+ */
+unsigned int
+cmd_UnwatchGPIO (struct libwebsocket *wsi, struct per_session_data *psd,
+                 struct msgbuf *out, char *args)
+{
+  struct gpio_watcher *watcher;
+  char *gpio_num, *saveptr;
+
+  print_log (LOG_INFO, "(%p) (cmd_UnwatchGPIO) processing request\n", wsi);
+
+  for (gpio_num = strtok_r (args, " ", &saveptr); gpio_num; gpio_num = strtok_r (NULL, " ", &saveptr))
+    {
+      watcher = g_hash_table_lookup (gpio_watchers, GINT_TO_POINTER (atoi (gpio_num)));
+      if (watcher)
+        gpio_watcher_remove (psd, watcher);
+    }
+
+  if (args[0] == '\0')
+    gpio_unwatch_all (psd);
+
+  return gpio_watched_json (wsi, psd, out, "UnwatchGPIO");
+}
+
+
+/*
+ * cmd_ResumeNotifications()
+ *
+ * args: "since <seq>"
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "NotificationsResumed": {
+ *     "since": 12,
+ *     "first": 9,
+ *     "last" : 15
+ *   }
+ * }
+ *
+ * Notifications after <seq> are sent again, as far back as the ring goes:
+ * "first" above <seq> + 1 means some are lost. A <seq> beyond "last" is
+ * from before a restart of the server and resumes from the oldest one.
+ * The notification being sent meanwhile may come twice.
+ */
+unsigned int
+cmd_ResumeNotifications (struct libwebsocket *wsi, struct per_session_data *psd,
+                         struct msgbuf *out, char *args)
+{
+  struct jsonw w;
+  guint64 since;
+
+  print_log (LOG_INFO, "(%p) (cmd_ResumeNotifications) processing request\n", wsi);
+
+  if (sscanf (args, " since %" G_GUINT64_FORMAT, &since) != 1)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_ResumeNotifications) invalid arguments\n", wsi);
+      return send_error (out, "Invalid arguments");
+    }
+
+  if (since > notification_seq)
+    since = 0;
+
+  /* the queued one may be past 'since' */
+  session_drop (psd, OUT_NOTIFICATION);
+  psd->notify_cursor = since;
+  session_notify (psd);
+
+  jsonw_init (&w, out);
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "NotificationsResumed");
+  jsonw_object_begin (&w);
+  jsonw_key (&w, "since");
+  jsonw_int (&w, since);
+  jsonw_key (&w, "first");
+  jsonw_int (&w, notification_first ());
+  jsonw_key (&w, "last");
+  jsonw_int (&w, notification_seq);
+  jsonw_object_end (&w);
+  jsonw_object_end (&w);
+
+  return send_written (wsi, "cmd_ResumeNotifications", &w);
+}
+
+
+/*
+ * Command registry
+ *
+ * Every command the server understands, with what it expects and how it
+ * may be run. Lookup goes through a perfect hash: COMMAND_HASH_SEED was
+ * picked so that no two names below share a slot, and the table is checked
+ * when it is filled at startup.
+ */
+#define COMMAND_TABLE_SIZE 32                /* power of 2 */
+#define COMMAND_HASH_SEED 4032
+
+static struct command command_registry [] = {
+  { "GetGPIO",        cmd_GetGPIO,        "",                         0, 0,         CMD_CACHEABLE | CMD_BATCHABLE, 100 },
+  { "GetTempSensors", cmd_GetTempSensors, "",                         0, 0,         CMD_CACHEABLE | CMD_BATCHABLE, 1000 },
+  { "GetProcesses",   cmd_GetProcesses,   "[since <seq>]",            0, 2,         CMD_CACHEABLE | CMD_BLOCKING | CMD_BATCHABLE, 500 },
+  { "GetStatistics",  cmd_GetStatistics,  "",                         0, 0,         CMD_CACHEABLE | CMD_BLOCKING | CMD_BATCHABLE, 500 },
+  { "GetStatisticsHistory", cmd_GetStatisticsHistory, "<from> <to> <maxpoints>", 3, 3, CMD_BATCHABLE },
+  { "SendIR",         cmd_SendIR,         "<remote> <code> [...]",    2, G_MAXUINT, CMD_BLOCKING | CMD_BATCHABLE },
+  { "SendIRStart",    cmd_SendIRStart,    "<remote> <code>",          2, 2,         CMD_BLOCKING | CMD_BATCHABLE },
+  { "SendIRStop",     cmd_SendIRStop,     "<remote> <code>",          2, 2,         CMD_BLOCKING | CMD_BATCHABLE },
+  { "SendIRSequence", NULL,               "<remote> <code> [<repeat> [<delay>]]; ...", 2, G_MAXUINT, CMD_ASYNC | CMD_BATCHABLE, 0, cmd_SendIRSequence },
+  { "RunIRMacro",     NULL,               "<macro>",                  1, 1,         CMD_ASYNC | CMD_BATCHABLE, 0, cmd_RunIRMacro },
+  { "GetIRMacros",    cmd_GetIRMacros,    "",                         0, 0,         CMD_BATCHABLE },
+  { "DefineIRMacro",  cmd_DefineIRMacro,  "<macro> <remote> <code> [<repeat> [<delay>]]; ...", 3, G_MAXUINT, CMD_BLOCKING | CMD_BATCHABLE },
+  { "DeleteIRMacro",  cmd_DeleteIRMacro,  "<macro>",                  1, 1,         CMD_BLOCKING | CMD_BATCHABLE },
+  { "SetGPIO",        cmd_SetGPIO,        "<gpio> <0|1|in|out>",      2, 2,         CMD_BATCHABLE },
+  { "KillProcess",    cmd_KillProcess,    "<pid> [since <seq>]",      1, 3,         CMD_BLOCKING | CMD_BATCHABLE },
+  { "Subscribe",      cmd_Subscribe,      "<command> [<interval>]",   1, 2,         CMD_BATCHABLE },
+  { "Unsubscribe",    cmd_Unsubscribe,    "<command>",                1, 1,         CMD_BATCHABLE },
+  { "WatchGPIO",      cmd_WatchGPIO,      "<gpio> [...]",             1, G_MAXUINT, CMD_BATCHABLE },
+  { "UnwatchGPIO",    cmd_UnwatchGPIO,    "[<gpio> ...]",             0, G_MAXUINT, CMD_BATCHABLE },
+  { "ResumeNotifications", cmd_ResumeNotifications, "since <seq>",      2, 2,         CMD_BATCHABLE },
+};
+
+static struct command *command_table [COMMAND_TABLE_SIZE];
+static guint32 command_seed = COMMAND_HASH_SEED;
+
+
+/*
+ * command_hash()
+ */
+static guint
+command_hash (const char *name, guint32 seed)
+{
+  guint32 hash = 2166136261u ^ seed;
+
+  while (*name)
+    {
+      hash ^= (guchar) *name++;
+      hash *= 16777619u;
+    }
+
+  /* the low bits alone only ever depend on the low bits of the seed */
+  return (hash ^ (hash >> 16)) & (COMMAND_TABLE_SIZE - 1);
+}
+
+
+/*
+ * command_table_fill()
+ */
+static gboolean
+command_table_fill (guint32 seed)
+{
+  guint i, slot;
+
+  memset (command_table, 0, sizeof (command_table));
+
+  for (i = 0; i < G_N_ELEMENTS (command_registry); i++)
+    {
+      slot = command_hash (command_registry[i].name, seed);
+      if (command_table[slot] != NULL)
+        return FALSE;
+      command_table[slot] = &command_registry[i];
+    }
+
+  return TRUE;
+}
+
+
+/*
+ * command_registry_init()
+ */
+static gboolean
+command_registry_init (void)
+{
+  guint32 seed;
+
+  if (command_table_fill (COMMAND_HASH_SEED))
+    return TRUE;
+
+  /* a command was added without updating the seed - find one that works */
+  for (seed = COMMAND_HASH_SEED + 1; seed < COMMAND_HASH_SEED + 100000; seed++)
+    if (command_table_fill (seed))
+      {
+        print_log (LOG_ERR, "(main) COMMAND_HASH_SEED collides, using %u instead\n", (unsigned) seed);
+        command_seed = seed;
+        return TRUE;
+      }
+
+  return FALSE;
+}
+
+
+/*
+ * command_find()
+ */
+static struct command *
+command_find (const char *name)
+{
+  struct command *command;
+
+  command = command_table[command_hash (name, command_seed)];
+  if (command == NULL || strcmp (command->name, name) != 0)
+    return NULL;
+
+  return command;
+}
+
+
+/*
+ * command_args_valid()
+ */
+static gboolean
+command_args_valid (const struct command *command, const char *args)
+{
+  guint n = 0;
+
+  while (*args)
+    {
+      while (*args == ' ')
+        args++;
+      if (*args == '\0')
+        break;
+      n++;
+      while (*args && *args != ' ')
+        args++;
+    }
+
+  return n >= command->min_args && n <= command->max_args;
+}
+
+
+/*
+ * command_begin()
+ *
+ * Looks the command up and checks its arguments and the response cache.
+ * Returns the command whose handler has to run, or NULL if the answer is
+ * in 'out' already - '*len' bytes of it.
+ */
+static struct command *
+command_begin (struct libwebsocket *wsi, const char *cmd_str, const char *args_str,
+               struct msgbuf *out, unsigned int *len)
+{
+  struct command *command;
+  struct msgbuf *cached;
+  gchar *error;
+
+  command = command_find (cmd_str);
+  if (command == NULL)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_parser) not supported command\n", wsi);
+      *len = send_error (out, "Not supported command");
+      return NULL;
+    }
+
+  metric_add (&command->stats.calls, 1);
+
+  if (!command_args_valid (command, args_str))
+    {
+      print_log (LOG_ERR, "(%p) (cmd_parser) invalid arguments for %s\n", wsi, command->name);
+      metric_add (&command->stats.errors, 1);
+      error = g_strdup_printf ("Invalid arguments - usage: %s %s", command->name, command->usage);
+      *len = send_error (out, error);
+      g_free (error);
+      return NULL;
+    }
+
+  if (command->flags & CMD_CACHEABLE)
+    {
+      cached = respcache_lookup (response_cache, command->name, args_str, out->encoding);
+      if (cached != NULL)
+        {
+          print_log (LOG_INFO, "(%p) (cmd_parser) %s served from cache\n", wsi, command->name);
+          metric_add (&command->stats.cache_hits, 1);
+          *len = msgbuf_append (out, msgbuf_payload (cached), cached->len) < 0 ? 0 : cached->len;
+          msgbuf_unref (cached);
+          return NULL;
+        }
+    }
+
+  return command;
+}
+
+
+/*
+ * command_end()
+ *
+ * Accounts for a handler which put 'len' bytes in 'out' from 'start' on,
+ * started at 't0' with the cache at 'generation'.
+ */
+static void
+command_end (struct command *command, const char *args_str, struct msgbuf *out,
+             size_t start, unsigned int len, gint64 t0, guint generation)
+{
+  struct msgbuf *cached;
+
+  histogram_record (&command->stats.latency, g_get_monotonic_time () - t0);
+
+  if (len > 0 && response_is_error (out->encoding, msgbuf_payload (out) + start, len))
+    metric_add (&command->stats.errors, 1);
+  else if (len > 0 && (command->flags & CMD_CACHEABLE))
+    {
+      cached = msgbuf_new (len);
+      if (cached != NULL)
+        cached->encoding = out->encoding;
+      if (cached != NULL && msgbuf_append (cached, msgbuf_payload (out) + start, len) == 0)
+        response_cache_store (command, args_str, cached, generation);
+      msgbuf_unref (cached);
+    }
+}
+
+
+/*
+ * Requests
+ *
+ * Every message received from a client becomes a request, run one command
+ * at a time. Handlers of CMD_BLOCKING commands are run by the worker pool
+ * and the request goes on in the main loop once they return, so a slow
+ * command holds up only the session which sent it. CMD_ASYNC commands are
+ * started in the main loop and call request_finish() once they are done,
+ * waiting on nothing but main loop sources meanwhile. The requests of a
+ * session are run one after another and answered in the order they came.
+ *
+ * Blocking handlers get no session and may only touch state guarded by
+ * its own lock.
+ */
+
+/*
+ * Framing of a RunCommands response in each encoding, the results go in
+ * between. CBOR: a map of one, key 1 ("Results"), an indefinite length
+ * array and its break.
+ */
+static const struct {
+  const char *head;
+  const char *separator;
+  const char *empty;                         /* result of a command with no output */
+  const char *tail;
+} batch_framing[MSGBUF_ENCODINGS] = {
+  [MSGBUF_JSON] = { "{\"Results\":[", ",", "null", "]}" },
+  [MSGBUF_CBOR] = { "\xa1\x01\x9f", "", "\xf6", "\xff" },
+};
+
+#define batch_append(req, part) \
+  msgbuf_append ((req)->out, batch_framing[(req)->out->encoding].part, \
+                 strlen (batch_framing[(req)->out->encoding].part))
+
+
+/*
+ * request_new()
+ */
+static struct request *
+request_new (struct libwebsocket *wsi, struct per_session_data *psd, enum msgbuf_encoding encoding)
+{
+  struct request *req;
+
+  req = g_new0 (struct request, 1);
+  req->out = msgbuf_new (FRAGMENT_SIZE);
+  if (req->out == NULL)
+    {
+      g_free (req);
+      return NULL;
+    }
+  req->out->encoding = encoding;
+
+  req->wsi = wsi;
+  req->psd = psd;
+  return req;
+}
+
+
+/*
+ * request_free()
+ */
+static void
+request_free (struct request *req)
+{
+  if (req->root != NULL)
+    json_decref (req->root);
+  msgbuf_unref (req->out);
+  g_free (req);
+}
+
+
+/*
+ * request_parse()
+ *
+ * {
+ *   "RunCommand": { "cmd": "GetGPIO", "args": "" }
+ * }
+ *
+ * or
+ *
+ * {
+ *   "RunCommands": [
+ *     { "cmd": "SetGPIO", "args": "17 1" },
+ *     { "cmd": "GetStatistics", "args": "" },
+ *     .
+ *     .
+ *   ]
+ * }
+ *
+ * JSON Object
+ * ===========
+ *
+ * {
+ *   "Results": [
+ *     { "GPIOState": [ ... ], "Revision": "0002" },
+ *     { "Statistics": { ... } },
+ *     .
+ *     .
+ *   ]
+ * }
+ *
+ * Results are in request order, commands with no output (SendIR) give null.
+ * A request which can't be parsed has no commands, its response is the error.
+ * Requests on the binary protocol are the same documents in CBOR.
+ */
+static void
+request_parse (struct request *req, const unsigned char *data, size_t len)
+{
+  json_error_t error;
+
+  if (req->out->encoding == MSGBUF_CBOR)
+    {
+      req->root = cbor_load (data, len);
+      if (!req->root)
+        print_log (LOG_ERR, "(%p) (cmd_parser) not valid CBOR data\n", req->wsi);
+    }
+  else
+    {
+      req->root = json_loadb ((const char *) data, len, 0, &error);
+      if (!req->root)
+        print_log (LOG_ERR, "(%p) (cmd_parser) parser error on line %d: %s\n", req->wsi, error.line, error.text);
+    }
+
+  if (!req->root)
+    {
+      send_error (req->out, "Could not parse command");
+      return;
+    }
+
+  req->commands = json_object_get (req->root, "RunCommands");
+  if (json_is_array (req->commands))
+    {
+      print_log (LOG_INFO, "(%p) (cmd_parser) running batch of %d commands\n", req->wsi, (int) json_array_size (req->commands));
+      req->count = json_array_size (req->commands);
+      batch_append (req, head);
+      return;
+    }
+
+  req->commands = NULL;
+
+  if (json_unpack (req->root, "{s:{s:s, s:s}}", "RunCommand", "cmd", &req->cmd_str, "args", &req->args_str) < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_parser) not valid JSON data\n", req->wsi);
+      send_error (req->out, "Could not parse command - not valid JSON data");
+      return;
+    }
+
+  req->count = 1;
+}
+
+
+/*
+ * request_result()
+ *
+ * Moves on past the command which gave 'len' bytes of result.
+ */
+static void
+request_result (struct request *req, unsigned int len)
+{
+  if (req->command != NULL)
+    {
+      command_end (req->command, req->args, req->out, req->start, len, req->t0, req->generation);
+      req->command = NULL;
+    }
+
+  if (req->commands != NULL && len == 0)
+    batch_append (req, empty);
+
+  req->next++;
+}
+
+
+/*
+ * request_complete()
+ */
+static void
+request_complete (struct request *req)
+{
+  if (req->commands != NULL && batch_append (req, tail) < 0)
+    {
+      print_log (LOG_ERR, "(%p) (cmd_parser) out of memory for batch response\n", req->wsi);
+      msgbuf_reset (req->out);
+      send_error (req->out, "Batch response too large");
+    }
+
+  req->done (req);
+  request_free (req);
+}
+
+
+/*
+ * Single flight
+ *
+ * A cacheable blocking command which misses the cache while a worker is
+ * computing the same response - command, arguments and encoding - doesn't
+ * take another worker for the same scan: its request is parked on the one
+ * in flight and resumed with a copy of the result once that is cached.
+ * Subscription refreshes go the same way. A write invalidating the command
+ * meanwhile makes the result stale - the parked requests are then run
+ * again, sharing one new computation.
+ */
+
+/*
+ * flight_join()
+ *
+ * Parks 'req' if its response is being computed, or makes it the one
+ * computing it.
+ */
+static gboolean
+flight_join (struct request *req, struct command *command)
+{
+  GQueue *waiters;
+  gchar *key;
+
+  key = respcache_key (command->name, req->args, req->out->encoding);
+  waiters = g_hash_table_lookup (inflight, key);
+  if (waiters != NULL)
+    {
+      g_free (key);
+      g_queue_push_tail (waiters, req);
+      return TRUE;
+    }
+
+  g_hash_table_insert (inflight, key, g_queue_new ());
+  req->flight = key;
+  return FALSE;
+}
+
+
+/*
+ * request_work()
+ *
+ * Hands the blocking command of 'req' to a worker, or parks it on the
+ * same response in flight.
+ */
+static void
+request_work (struct request *req)
+{
+  /* parked, goes on in flight_land() */
+  if ((req->command->flags & CMD_CACHEABLE) && flight_join (req, req->command))
+    return;
+
+  /* goes on in request_resume() */
+  g_thread_pool_push (workers, req, NULL);
+}
+
+
+/*
+ * flight_land()
+ *
+ * Hands the result of 'req' to the requests parked on it.
+ */
+static void
+flight_land (struct request *req)
+{
+  struct request *waiter;
+  GQueue *waiters;
+  gpointer key;
+  guint generation;
+  unsigned int len;
+
+  if (req->flight == NULL)
+    return;
+
+  g_hash_table_lookup_extended (inflight, req->flight, &key, (gpointer *) &waiters);
+  g_hash_table_steal (inflight, key);
+  req->flight = NULL;
+
+  while ((waiter = g_queue_pop_head (waiters)) != NULL)
+    {
+      if (waiter->cancelled)
+        {
+          request_free (waiter);
+          continue;
+        }
+
+      generation = respcache_generation (response_cache, waiter->command->name);
+      if (generation != req->generation)
+        {
+          waiter->generation = generation;
+          request_work (waiter);
+          continue;
+        }
+
+      metric_add (&waiter->command->stats.cache_hits, 1);
+      waiter->command = NULL;
+
+      len = msgbuf_append (waiter->out, msgbuf_payload (req->out) + req->start, req->len) < 0 ? 0 : req->len;
+      request_result (waiter, len);
+      request_run (waiter);
+    }
+
+  g_queue_free (waiters);
+  g_free (key);
+}
+
+
+/*
+ * request_run()
+ *
+ * Runs the request from where it stopped until it is complete or waits
+ * for a worker.
+ */
+static void
+request_run (struct request *req)
+{
+  struct command *command;
+  const char *cmd_str;
+  char *args_str;
+  unsigned int len;
 
-  while(1)
+  while (req->next < req->count)
     {
-      json_t *proc_entry_obj;
-
-      proc_pid_dir = readdir (proc_dir);
-      if (proc_pid_dir == NULL)
-        break;
-
-      if ((proc_pid_dir->d_type != DT_DIR) || (!isdigit((unsigned char) proc_pid_dir->d_name[0])))
-        continue;
+      /* every result is serialized right behind the previous one */
+      if (req->commands != NULL && req->next > 0)
+        batch_append (req, separator);
 
-      snprintf(filepath, PATH_MAX, "/proc/%s/status", proc_pid_dir->d_name);
-      proc_pid_status = fopen(filepath, "r");
-      if (proc_pid_status == NULL)
-        continue;
+      req->start = req->out->len;
+      command = NULL;
 
-      proc_entry_obj = json_object();
-      json_object_set_new (proc_entry_obj, "pid", json_integer (atoi (proc_pid_dir->d_name)));
+      if (req->commands == NULL)
+        {
+          args_str = req->args_str;
+          command = command_begin (req->wsi, req->cmd_str, args_str, req->out, &len);
+        }
+      else if (json_unpack (json_array_get (req->commands, req->next), "{s:s, s:s}", "cmd", &cmd_str, "args", &args_str) < 0)
+        len = send_error (req->out, "Could not parse command - not valid JSON data");
+      else if ((command = command_find (cmd_str)) != NULL && !(command->flags & CMD_BATCHABLE))
+        {
+          command = NULL;
+          len = send_error (req->out, "Command not allowed in a batch");
+        }
+      else
+        command = command_begin (req->wsi, cmd_str, args_str, req->out, &len);
 
-      while (1)
+      if (command != NULL)
         {
-          if (fgets (fileline, 1000, proc_pid_status) == NULL)
-            break;
+          req->command = command;
+          req->args = args_str;
+          req->t0 = g_get_monotonic_time ();
+          if (command->flags & CMD_CACHEABLE)
+            req->generation = respcache_generation (response_cache, command->name);
 
-          if (strncmp(fileline, "Name:", 5) == 0)
+          if (command->flags & CMD_ASYNC)
             {
-              fileline [strlen(fileline)-1] = 0;
-              for (ptr = fileline + 5; *ptr != '\0' && isspace((unsigned char) *ptr);)
-                ptr++;
-
-              json_object_set_new (proc_entry_obj, "name", json_string (ptr));
+              /* goes on in request_finish() */
+              command->start (req, args_str);
+              return;
             }
 
-          if (strncmp(fileline, "Uid:", 4) == 0)
+          if (command->flags & CMD_BLOCKING)
             {
-              struct passwd *pw;
-
-              if ((pw = getpwuid ((unsigned int) strtol(fileline + 4, NULL, 10))))
-                json_object_set_new (proc_entry_obj, "user", json_string (pw->pw_name));
+              request_work (req);
+              return;
             }
 
-          if (strncmp(fileline, "State:", 6) == 0)
-            {
-              fileline [strlen(fileline)-1] = 0;
-              for (ptr = fileline + 6; *ptr != '\0' && isspace((unsigned char) *ptr);)
-                ptr++;
-
-              json_object_set_new (proc_entry_obj, "state", json_string (ptr));
-            }
+          len = command->handler (req->wsi, req->psd, req->out, args_str);
         }
 
-      json_array_append (proc_array_obj, proc_entry_obj);
-      json_decref (proc_entry_obj);
-
-      fclose (proc_pid_status);
+      request_result (req, len);
     }
 
-  json_object_set (proc_obj, "Processes", proc_array_obj);
-  if (proc_obj == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_Processes) can't prepare valid JSON object\n", wsi);
-      json_decref (proc_array_obj);
-      json_decref (proc_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
+  request_complete (req);
+}
 
-  proc_str = json_dumps (proc_obj, 0);
-  if (proc_str == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_GetProcesses) can't prepare valid JSON object\n", wsi);
-      json_decref (proc_array_obj);
-      json_decref (proc_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
 
-  proc_len = strlen (proc_str);
-  memcpy (buffer, proc_str, proc_len);
+/*
+ * request_resume()
+ *
+ * Called in the main loop when a worker is done with the request.
+ */
+static gboolean
+request_resume (gpointer user_data)
+{
+  struct request *req = user_data;
 
-  if (opt_show_json_obj)
-    print_log (LOG_INFO, "(%p) (cmd_GetProcesses) %s\n", wsi, proc_str);
+  /* cached before the parked requests are answered */
+  request_result (req, req->len);
+  flight_land (req);
 
-  json_decref (proc_array_obj);
-  json_decref (proc_obj);
-  free (proc_str);
+  if (req->cancelled)
+    request_free (req);
+  else
+    request_run (req);
 
-  return proc_len;
+  return FALSE;
 }
 
 
 /*
- * cmd_GetStatistics()
- *
- * JSON Object
- * ===========
- *
- * {
- *   "Statistics": {
- *      "kernel": "3.2.27+",
- *      "uptime": "1h 16m 39s",
- *      "serial": "00000000b62b4ab1",
- *      "mac_addr": "a1:eb:27:13:aa:b3",
- *      "used_space": 2.21,
- *      "free_space": 7.23,
- *      "ram_usage": 51,
- *      "swap_usage": 24,
- *      "cpu_load": "0.00 0.01 0.05",
- *      "cpu_temp": 44,
- *      "cpu_usage": 23
- *   }
- * }
+ * request_finish()
  *
+ * Called in the main loop when a CMD_ASYNC command has put its 'len'
+ * bytes of result in the response.
  */
-bool eth_filter(const char *name)
+static void
+request_finish (struct request *req, unsigned int len)
 {
-	if (strcmp(name, "eth0") == 0)
-		return true;
-	return false;
+  req->len = len;
+  request_resume (req);
 }
 
-bool fs_filter(const char *name)
-{
-	if (strcmp(name, "/") == 0)
-		return true;
-	return false;
-}
 
-unsigned int
-cmd_GetStatistics (struct libwebsocket *wsi, unsigned char *buffer)
+/*
+ * request_worker()
+ */
+static void
+request_worker (gpointer data, gpointer user_data)
 {
-  json_t *stat_obj;
-  char *stat_str;
-  int stat_len;
-  struct devman_ctx *dctx;
-
-  char *kernel, *uptime, *serial, *mac_addr, *cpu_load;
-  int ram_usage, swap_usage, cpu_temp, cpu_usage;
-  double used_space, free_space;
-  uint64_t sused, sfree;
-  char **arr;
-  int i, n;
-
-  print_log (LOG_INFO, "(%p) (cmd_GetStatistics) processing request\n", wsi);
-
-  dctx = devman_ctx_init();
-  if (dctx == NULL)
-	  return 0;
-
-  kernel = get_kernel_version(dctx);
-  uptime = get_uptime_str(dctx);
-  serial = get_rpi_serial();
-  n = get_netdevices(&arr, eth_filter);
-  mac_addr = NULL;
-  sscanf(arr[0], "%*[a-z0-9:] %ms", &mac_addr);
-  FREE_ARRAY_ELEMENTS(arr, i, n);
-  n = get_df(&arr, fs_filter);
-  sscanf(arr[0], "%*s %*s %"SCNu64" %"SCNu64, &sused, &sfree);
-  used_space = sused / 1024.0 / 1024.0;
-  free_space = sfree / 1024.0 / 1024.0;
-  FREE_ARRAY_ELEMENTS(arr, i, n);
-  ram_usage =  total_mem_usage(dctx, false);
-  swap_usage =  total_mem_usage(dctx, true);
-  cpu_load = get_cpuload_str(dctx);
-  cpu_temp =  get_rpi_cpu_temp();
-  cpu_usage = total_cpu_usage();
-
-  stat_obj = json_pack ("{s:{s:s, s:s, s:s, s:s, s:f, s:f, s:i, s:i, s:s, s:i, s:i}}",
-                        "Statistics",
-                        "kernel", kernel,
-                        "uptime", uptime,
-                        "serial", serial,
-                        "mac_addr", mac_addr,
-                        "used_space", used_space,
-                        "free_space", free_space,
-                        "ram_usage", ram_usage,
-                        "swap_usage", swap_usage,
-                        "cpu_load", cpu_load,
-                        "cpu_temp", cpu_temp,
-                        "cpu_usage", cpu_usage);
-  if (stat_obj == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_GetStatistics) can't prepare valid JSON object\n", wsi);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
-
-  stat_str = json_dumps (stat_obj, 0);
-  if (stat_str == NULL)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_GetStatistics) can't prepare valid JSON object\n", wsi);
-      json_decref (stat_obj);
-      return send_error (buffer, "Can't prepare valid JSON object");
-    }
+  struct request *req = data;
 
-  stat_len = strlen (stat_str);
-  memcpy (buffer, stat_str, stat_len);
-
-  if (opt_show_json_obj)
-    print_log (LOG_INFO, "(%p) (cmd_GetStatistics) %s\n", wsi, stat_str);
-
-  free (stat_str);
-  json_decref (stat_obj);
-  free(kernel);
-  free(uptime);
-  free(serial);
-  free(mac_addr);
-  devman_ctx_free(dctx);
-  return stat_len;
+  req->len = req->command->handler (req->wsi, NULL, req->out, req->args);
+  g_main_context_invoke (NULL, request_resume, req);
 }
 
 
 /*
- * cmd_SendIR()
+ * session_request_done()
  */
-unsigned int
-cmd_SendIR (struct libwebsocket *wsi, unsigned char *buffer, char *args)
+static void
+session_request_done (struct request *req)
 {
-  char *cmd;
-  int ret;
-
-  print_log (LOG_INFO, "(%p) (cmd_SendIR) processing request\n", wsi);
+  struct per_session_data *psd = req->psd;
 
-  ret = asprintf (&cmd, "irsend SEND_ONCE %s", args);
-  if (ret < 0)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_SendIR) can't prepare LIRC command\n", wsi);
-      return send_error (buffer, "Can't prepare LIRC command");
-    }
+  if (req->out->len > 0)
+    session_enqueue (psd, req->out, OUT_RESPONSE);
 
-  /*
-   * Invoking system() function is temporary solution - we'll switch soon to
-   * liblirc_client and lirc_send_one() - which will be available in next lirc
-   * release.
-   */
-  ret = system (cmd);
-  if (ret != 0)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_SendIR) can't send signal\n", wsi);
-      free (cmd);
-      return send_error (buffer, "Can't send signal - please check server's log");
-    }
+  g_queue_pop_head (&psd->requests);
+  session_throttle (psd);
 
-  free (cmd);
-  return 0;
+  /* the next one was waiting for this one */
+  if (!g_queue_is_empty (&psd->requests))
+    request_run (g_queue_peek_head (&psd->requests));
 }
 
 
 /*
- * cmd_SetGPIO()
+ * session_cancel()
+ *
+ * Drops the requests of a closed session - the one on a worker is freed
+ * when it comes back.
  */
-unsigned int
-cmd_SetGPIO (struct libwebsocket *wsi, unsigned char *buffer, char *args)
+static void
+session_cancel (struct per_session_data *psd)
 {
-  FILE *fd;
-  char filepath [PATH_MAX];
-  char *gpio_num;
-  char *gpio_act;
-
-  print_log (LOG_INFO, "(%p) (cmd_SetGPIO) processing request\n", wsi);
-
-  /* TODO - strcpy? */
-  gpio_num = strtok (args, " ");
-  gpio_act = strtok (NULL, " ");
+  struct request *req;
 
-  if ((strcmp(gpio_act, "1") == 0) || (strcmp(gpio_act, "0") == 0))
+  while ((req = g_queue_pop_head (&psd->requests)) != NULL)
     {
-      snprintf (filepath, PATH_MAX, "/sys/class/gpio/gpio%s/value", gpio_num);
-      fd = fopen(filepath, "w");
-      if (!fd)
+      if (req->command != NULL)
         {
-          print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unable to change GPIO value\n", wsi);
-          return send_error (buffer, "Unable to change GPIO value");
-        }
-      fprintf (fd, "%s", gpio_act);
-      fclose (fd);
-    }
-  else if ((strcmp(gpio_act, "in") == 0) || (strcmp(gpio_act, "out") == 0))
-    {
-      snprintf (filepath, PATH_MAX, "/sys/class/gpio/gpio%s/direction", gpio_num);
-      fd = fopen(filepath, "w");
-      if (!fd)
-        {
-          print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unable to change GPIO direction\n", wsi);
-          return send_error (buffer, "Unable to change GPIO direction");
+          req->cancelled = TRUE;
+          req->psd = NULL;
         }
-      fprintf (fd, "%s", gpio_act);
-      fclose (fd);
-    }
-  else
-    {
-      print_log (LOG_ERR, "(%p) (cmd_SetGPIO) Unsupported value - please report a bug\n", wsi);
-      return send_error (buffer, "Unsupported value - please report a bug");
+      else
+        request_free (req);
     }
-
-  return cmd_GetGPIO (wsi, buffer);
 }
 
 
 /*
- * cmd_KillProcess()
+ * metrics_response()
+ *
+ * Prometheus text exposition format, served over HTTP on GET /metrics.
  */
-unsigned int
-cmd_KillProcess (struct libwebsocket *wsi, unsigned char *buffer, char *pid_str)
+static struct msgbuf *
+metrics_response (void)
 {
-  unsigned int pid;
-
-  print_log (LOG_INFO, "(%p) (cmd_KillProcess) processing request\n", wsi);
-
-  if (pid_str)
+  static const char *command_counters[][2] = {
+    { "rcs_command_calls_total", "Commands run, subscription refreshes included" },
+    { "rcs_command_errors_total", "Commands answered with an error" },
+    { "rcs_command_cache_hits_total", "Commands answered from the response cache or a computation in flight" },
+  };
+  struct per_session_data *psd;
+  struct command *command;
+  struct msgbuf *msg;
+  GString *body;
+  gsize queued = 0;
+  gchar *labels;
+  GList *l;
+  guint i, j;
+
+  body = g_string_sized_new (16384);
+
+  for (j = 0; j < G_N_ELEMENTS (command_counters); j++)
     {
-      pid = atoi (pid_str);
-      if (pid)
-        {
-          gint ret;
-
-          ret = kill (pid, SIGKILL);
-          if (ret < 0)
-            goto error;
-          print_log (LOG_INFO, "(%p) (cmd_KillProcess) send SIGKILL to PID %d\n", wsi, (int) pid);
-        }
-      else
+      metrics_format_header (body, command_counters[j][0], "counter", command_counters[j][1]);
+      for (i = 0; i < G_N_ELEMENTS (command_registry); i++)
         {
-          goto error;
+          command = &command_registry[i];
+          labels = g_strdup_printf ("cmd=\"%s\"", command->name);
+          metrics_format_value (body, command_counters[j][0], labels,
+                                metric_get (j == 0 ? &command->stats.calls :
+                                            j == 1 ? &command->stats.errors : &command->stats.cache_hits));
+          g_free (labels);
         }
     }
-  else
+
+  metrics_format_header (body, "rcs_command_duration_seconds", "histogram", "Time spent running a command");
+  for (i = 0; i < G_N_ELEMENTS (command_registry); i++)
     {
-      goto error;
+      command = &command_registry[i];
+      if (metric_get (&command->stats.latency.count) == 0)
+        continue;
+      labels = g_strdup_printf ("cmd=\"%s\"", command->name);
+      metrics_format_histogram (body, "rcs_command_duration_seconds", labels, &command->stats.latency);
+      g_free (labels);
     }
-  
-  return cmd_GetProcesses (wsi, buffer);
 
-error:
-  print_log (LOG_ERR, "(%p) (cmd_KillProcess) Can't kill selected process\n", wsi);
-  return send_error (buffer, "Can't kill selected process");
-}
+  metrics_format_header (body, "rcs_write_duration_seconds", "histogram", "Time spent writing to a websocket");
+  metrics_format_histogram (body, "rcs_write_duration_seconds", NULL, &server_metrics.write_latency);
 
+  metrics_format_header (body, "rcs_loop_busy_seconds", "histogram", "Time an event loop iteration spends handling events");
+  metrics_format_histogram (body, "rcs_loop_busy_seconds", NULL, &server_metrics.loop_busy);
 
-/*
- * parse_json()
- */
-unsigned int
-parse_json (struct libwebsocket  *wsi,
-            unsigned char        *data,
-            unsigned char        *buffer)
-{
-  json_t *root;
-  json_error_t error;
-  char *cmd_str, *args_str;
-  int result;
-  unsigned int len = 0;
+  metrics_format_header (body, "rcs_bytes_written_total", "counter", "Payload bytes written to websockets");
+  metrics_format_value (body, "rcs_bytes_written_total", NULL, metric_get (&server_metrics.bytes_written));
 
-  root = json_loads ((char*) data, 0, &error);
-  if(!root)
-    {
-      print_log (LOG_ERR, "(%p) (cmd_parser) parser error on line %d: %s\n", wsi, error.line, error.text);
-      return send_error (buffer, "Could not parse command");
-    }
+  metrics_format_header (body, "rcs_messages_written_total", "counter", "Messages written to websockets");
+  metrics_format_value (body, "rcs_messages_written_total", NULL, metric_get (&server_metrics.messages_written));
 
-  result = json_unpack (root, "{s:{s:s, s:s}}", "RunCommand", "cmd", &cmd_str, "args", &args_str);
-  if (result < 0)
+  metrics_format_header (body, "rcs_partial_writes_total", "counter", "Messages which didn't fit in the socket at once");
+  metrics_format_value (body, "rcs_partial_writes_total", NULL, metric_get (&server_metrics.partial_writes));
+
+  for (l = sessions; l; l = l->next)
     {
-      print_log (LOG_ERR, "(%p) (cmd_parser) not valid JSON data\n", wsi);
-      json_decref (root);
-      return send_error (buffer, "Could not parse command - not valid JSON data");
+      psd = l->data;
+      queued += psd->out_bytes;
     }
 
-  if (strcmp(cmd_str, "GetGPIO") == 0) 
-    len = cmd_GetGPIO (wsi, buffer);
-  else if (strcmp(cmd_str, "GetTempSensors") == 0)
-    len = cmd_GetTempSensors (wsi, buffer);
-  else if (strcmp(cmd_str, "GetProcesses") == 0)
-    len = cmd_GetProcesses (wsi, buffer);
-  else if (strcmp(cmd_str, "GetStatistics") == 0)
-    len = cmd_GetStatistics (wsi, buffer);
-  else if (strcmp(cmd_str, "SendIR") == 0)
-    len = cmd_SendIR (wsi, buffer, args_str);
-  else if (strcmp(cmd_str, "SetGPIO") == 0)
-    len = cmd_SetGPIO (wsi, buffer, args_str);
-  else if (strcmp(cmd_str, "KillProcess") == 0)
-    len = cmd_KillProcess (wsi, buffer, args_str);
-  else 
+  metrics_format_header (body, "rcs_sessions", "gauge", "Connected websocket clients");
+  metrics_format_value (body, "rcs_sessions", NULL, g_list_length (sessions));
+
+  metrics_format_header (body, "rcs_queued_bytes", "gauge", "Bytes waiting in the outbound queues");
+  metrics_format_value (body, "rcs_queued_bytes", NULL, queued);
+
+  metrics_format_header (body, "rcs_worker_queue", "gauge", "Blocking commands waiting for a worker");
+  metrics_format_value (body, "rcs_worker_queue", NULL, g_thread_pool_unprocessed (workers));
+
+  msg = msgbuf_new (body->len + 256);
+  if (msg != NULL)
     {
-      print_log (LOG_ERR, "(%p) (cmd_parser) not supported command\n", wsi);
-      json_decref (root);
-      return send_error (buffer, "Not supported command");
+      gchar *header;
+
+      header = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %u\r\n"
+                                "Connection: close\r\n\r\n", (unsigned) body->len);
+      msgbuf_append (msg, header, strlen (header));
+      msgbuf_append (msg, body->str, body->len);
+      g_free (header);
     }
 
-  /* TODO - free cmd_str and args_str? */
-  json_decref (root);
-  return len;
-} 
+  g_string_free (body, TRUE);
+  return msg;
+}
 
 
 /*
@@ -1030,43 +3701,72 @@ raspberry_control_callback (struct libwebsocket_context *context,
                             void *user, void *in, size_t len)
 {
   struct per_session_data *psd = (struct per_session_data*) user;
-  int nbytes;
+  struct request *req;
+  int ret;
+  guint i;
 
   switch (reason)
     {
 
       case LWS_CALLBACK_ESTABLISHED: 
         print_log (LOG_INFO, "(%p) (callback) connection established\n", wsi);
+        psd->wsi = wsi;
+        /* protocols[] is indexed by encoding */
+        psd->encoding = libwebsockets_get_protocol (wsi)->protocol_index;
+        /* only what comes from now on, unless resumed */
+        psd->notify_cursor = notification_seq;
+        sessions = g_list_prepend (sessions, psd);
       break;
 
       case LWS_CALLBACK_CLOSED:
         print_log (LOG_INFO, "(%p) (callback) connection closed\n", wsi);
+        for (i = 0; i < SUBSCRIPTION_COUNT; i++)
+          subscription_drop (psd, &subscriptions[i]);
+        gpio_unwatch_all (psd);
+        session_cancel (psd);
+        session_flush (psd);
+        sessions = g_list_remove (sessions, psd);
       break;
 
       case LWS_CALLBACK_SERVER_WRITEABLE:
 
-        /* broadcast message */
-        if (psd->buf[LWS_SEND_BUFFER_PRE_PADDING] == 0)
+        /* send as much as the socket takes, a message may span several callbacks */
+        do
           {
-            psd->len = strlen (notification);
-            if (psd->len == 0)
-              return 0;
-            memcpy (&psd->buf[LWS_SEND_BUFFER_PRE_PADDING], notification, psd->len);
+            size_t offset;
+            gint64 t0;
+
+            if (psd->tx == NULL)
+              psd->tx = session_next (psd);
+            if (psd->tx == NULL)
+              break;
+
+            offset = psd->tx_offset;
+            t0 = g_get_monotonic_time ();
+            ret = msgbuf_write (wsi, psd->tx, &psd->tx_offset, FRAGMENT_SIZE,
+                                psd->encoding == MSGBUF_CBOR ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+            histogram_record (&server_metrics.write_latency, g_get_monotonic_time () - t0);
+            metric_add (&server_metrics.bytes_written, psd->tx_offset - offset);
+
+            if (ret < 0)
+              {
+                print_log (LOG_ERR, "(%p) (callback) error writing to socket, hanging up\n", wsi);
+                return 1;
+              }
+            if (ret > 0)
+              {
+                metric_add (&server_metrics.partial_writes, 1);
+                break;
+              }
+
+            print_log (LOG_INFO, "(%p) (callback) %d bytes written\n", wsi, (int) psd->tx->len);
+            metric_add (&server_metrics.messages_written, 1);
+            session_sent (psd);
           }
+        while (!lws_send_pipe_choked (wsi));
 
-        nbytes = libwebsocket_write(wsi, &psd->buf[LWS_SEND_BUFFER_PRE_PADDING], psd->len, LWS_WRITE_TEXT);
-        memset (&psd->buf[LWS_SEND_BUFFER_PRE_PADDING], 0, psd->len);
-        print_log (LOG_INFO, "(%p) (callback) %d bytes written\n", wsi, nbytes);
-        if (nbytes < 0)
-          {
-            print_log (LOG_ERR, "(%p) (callback) %d bytes writing to socket, hanging up\n", wsi, nbytes);
-            return 1;
-          }
-        if (nbytes < (int)psd->len)
-          {
-            print_log (LOG_ERR, "(%p) (callback) partial write\n", wsi);
-            return -1; /*TODO*/
-          }
+        if (psd->tx != NULL || !g_queue_is_empty (&psd->outq))
+          libwebsocket_callback_on_writable (context, wsi);
       break;
 
       case LWS_CALLBACK_RECEIVE:
@@ -1077,11 +3777,71 @@ raspberry_control_callback (struct libwebsocket_context *context,
             return 1;
           }
 
-        psd->len = parse_json (wsi, in, &psd->buf[LWS_SEND_BUFFER_PRE_PADDING]);
-        if (psd->len > 0)
+        req = request_new (wsi, psd, psd->encoding);
+        if (req == NULL)
+          {
+            print_log (LOG_ERR, "(%p) (callback) out of memory, hanging up\n", wsi);
+            return 1;
+          }
+
+        request_parse (req, in, len);
+        req->done = session_request_done;
+        g_queue_push_tail (&psd->requests, req);
+        session_throttle (psd);
+
+        /* otherwise it waits for the ones before it */
+        if (g_queue_get_length (&psd->requests) == 1)
+          request_run (req);
+      break;
+
+      /* descriptors to be polled by the GLib main loop */
+      case LWS_CALLBACK_ADD_POLL_FD:
+      case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+        {
+          struct libwebsocket_pollargs *pa = in;
+
+          lws_watch_set (pa->fd, pa->events);
+        }
+      break;
+
+      case LWS_CALLBACK_DEL_POLL_FD:
+        g_hash_table_remove (lws_watches, GINT_TO_POINTER (((struct libwebsocket_pollargs *) in)->fd));
+      break;
+
+      /* plain HTTP on the same port, only for the metrics */
+      case LWS_CALLBACK_HTTP:
+        if (strcmp (in, "/metrics") != 0)
+          {
+            libwebsockets_return_http_status (context, wsi, 404, NULL);
+            return -1;
+          }
+
+        psd->tx = metrics_response ();
+        psd->tx_offset = 0;
+        if (psd->tx == NULL)
+          return -1;
+        libwebsocket_callback_on_writable (context, wsi);
+      break;
+
+      case LWS_CALLBACK_HTTP_WRITEABLE:
+        if (psd->tx == NULL)
+          return -1;
+
+        ret = msgbuf_write (wsi, psd->tx, &psd->tx_offset, FRAGMENT_SIZE, LWS_WRITE_HTTP);
+        if (ret > 0)
           {
             libwebsocket_callback_on_writable (context, wsi);
+            break;
           }
+
+        /* all sent (or failed) - close the connection */
+        msgbuf_unref (psd->tx);
+        psd->tx = NULL;
+      return -1;
+
+      case LWS_CALLBACK_CLOSED_HTTP:
+        msgbuf_unref (psd->tx);
+        psd->tx = NULL;
       break;
 
       default:
@@ -1096,12 +3856,17 @@ raspberry_control_callback (struct libwebsocket_context *context,
  * Defined protocols
  */
 static struct libwebsocket_protocols protocols[] = {
-  {
+  [MSGBUF_JSON] = {
     "raspberry_control_protocol",     /* protocol name */
     raspberry_control_callback,       /* callback */
     sizeof(struct per_session_data)   /* max frame size / rx buffer */
   },
-  {
+  [MSGBUF_CBOR] = {
+    "raspberry_control_protocol_bin", /* same commands in CBOR, see cbor.h */
+    raspberry_control_callback,
+    sizeof(struct per_session_data)
+  },
+  [MSGBUF_ENCODINGS] = {
     NULL, NULL, 0
   }
 };
@@ -1120,9 +3885,13 @@ main(int argc, char **argv)
   char cert_path [1024];
   char key_path [1024];
   char *res_path = "/path/to/cert";
+  gchar *stats_path;
 
-  gint cnt = 0;
   gint signal_id = 0;
+  gint sampler_id = 0;
+  gint stats_id = 0;
+  gint stats_sync_id = 0;
+  gint timeout_id = 0;
   gint exit_value = EXIT_SUCCESS;
   struct lws_context_creation_info info;
 
@@ -1154,7 +3923,7 @@ main(int argc, char **argv)
   info.port = port;
   info.iface = NULL;
   info.protocols = protocols;
-  info.extensions = libwebsocket_get_internal_extensions();
+  info.extensions = opt_no_deflate ? NULL : libwebsocket_get_internal_extensions();
   info.gid = -1;
   info.uid = -1;
   info.options = 0;
@@ -1189,6 +3958,14 @@ main(int argc, char **argv)
       info.ssl_private_key_filepath = key_path;
     }
 
+  /* fill the command lookup table */
+  if (!command_registry_init ())
+    {
+      print_log (LOG_ERR, "(main) can't build command lookup table\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+
   /* check board revision */
   if (!check_board_revision())
     print_log (LOG_ERR, "(main) Something goes wrong - can't check board revision\n");
@@ -1211,10 +3988,110 @@ main(int argc, char **argv)
       dbus_set_notification (connection, NULL, "com.redhat.PrinterSpooler", "JobQueuedLocal", NULL);
     }
 
+  /* system information shared by all requests, filled before the first one */
+  devman = devman_ctx_init ();
+  if (devman == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't initialize device manager context\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+  devman_ctx_set_refresh (devman, DEVMAN_SYSINFO, MAX (sysinfo_refresh, 0));
+  if (devman_ctx_update (devman) < 0)
+    print_log (LOG_ERR, "(main) can't read system information, retrying on first use\n");
+
+  /* open the exported GPIO's once */
+  if (opt_gpio_path)
+    gpio_set_sysfs_root (opt_gpio_path);
+  gpio_watchers = g_hash_table_new (g_direct_hash, g_direct_equal);
+  gpio_table = gpio_table_new ();
+  if (gpio_table == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't allocate GPIO handle table\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+  if (gpio_table_rescan (gpio_table) < 0)
+    print_log (LOG_ERR, "(main) unable to read the list of exported GPIO's\n");
+
+  /* start sampling /proc/stat in the background */
+  cpu_sampler = cpu_sampler_new ();
+  if (cpu_sampler == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't initialize CPU usage sampler\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+  cpu_sampler_update (cpu_sampler);
+  sampler_id = g_timeout_add (CPU_SAMPLE_INTERVAL, cpu_sampler_tick, NULL);
+
+  /* statistics history, for charts - kept across restarts if the file can be */
+  stats_path = g_path_get_dirname (opt_stats_file ? opt_stats_file : STAT_FILE_DEFAULT_PATH);
+  g_mkdir_with_parents (stats_path, 0755);
+  g_free (stats_path);
+  stats_path = opt_stats_file ? opt_stats_file : STAT_FILE_DEFAULT_PATH;
+
+  stat_history = stat_history_open (stats_path, stats_interval);
+  if (stat_history == NULL && errno != EINVAL)
+    {
+      print_log (LOG_ERR, "(main) can't open %s: %s - statistics history kept in memory only\n",
+                 stats_path, g_strerror (errno));
+      stat_history = stat_history_new (stats_interval);
+    }
+  if (stat_history == NULL)
+    {
+      print_log (LOG_ERR, "(main) --stats-interval has to divide 60\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+  stats_id = g_timeout_add_seconds (stats_interval, stats_sample_tick, NULL);
+  stats_sync_id = g_timeout_add_seconds (MAX (stats_sync_interval, 1), stats_sync_tick, NULL);
+
+  /* responses of read-only commands shared by all clients */
+  response_cache = respcache_new ();
+  inflight = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* lircd is connected to on the first IR command */
+  lirc = lirc_client_new (opt_lirc_socket ? opt_lirc_socket : LIRC_DEFAULT_SOCKET);
+  if (lirc == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't allocate lircd client\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+
+  /* named IR sequences */
+  ir_macros = ir_macros_load (opt_ir_macros ? opt_ir_macros : IR_MACROS_DEFAULT_PATH);
+  if (ir_macros == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't load IR macros\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+
+  /* threads running the blocking commands */
+  workers = g_thread_pool_new (request_worker, NULL, MAX (max_workers, 1), FALSE, NULL);
+  ir_senders = g_thread_pool_new (ir_sender, NULL, 1, FALSE, NULL);
+
+  /* keep the last few process table snapshots for delta updates */
+  proc_history = proc_history_new ();
+  if (proc_history == NULL)
+    {
+      print_log (LOG_ERR, "(main) can't allocate process table history\n");
+      exit_value = EXIT_FAILURE;
+      goto out;
+    }
+
+  /* start 1-wire acquisition - don't scan the bus if daemon has limited privileges */
+  if (w1_engine_start (geteuid() == 0, w1_read_interval, w1_rescan_interval) < 0)
+    print_log (LOG_ERR, "(main) can't start 1-wire acquisition engine\n");
+
   /* handle SIGINT */
+  main_loop = g_main_loop_new (NULL, FALSE);
   signal_id = g_unix_signal_add (SIGINT, sigint_handler, NULL);
 
-  /* create context */
+  /* create context - its descriptors are added to the main loop right away */
+  lws_watches = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, lws_watch_free);
   context = libwebsocket_create_context (&info);
   if (context == NULL)
     {
@@ -1224,25 +4101,49 @@ main(int argc, char **argv)
   print_log (LOG_INFO, "(main) context - %p\n", context);
 
   /* main loop */
-  while (cnt >= 0 && !exit_loop)
-    {
-      cnt = libwebsocket_service (context, 10);
-
-      if (send_notification)
-        {
-          libwebsocket_callback_on_writable_all_protocol (&protocols[0]);
-          send_notification = FALSE;
-        }
-
-      g_main_context_iteration (NULL, FALSE);
-    }
+  timeout_id = g_timeout_add_seconds (1, lws_timeout_tick, NULL);
+  g_main_context_set_poll_func (NULL, loop_poll);
+  g_main_loop_run (main_loop);
 
 out:
 
+  /* let the running handlers finish, drop the queued ones */
+  if (workers != NULL)
+    g_thread_pool_free (workers, TRUE, TRUE);
+  if (ir_senders != NULL)
+    g_thread_pool_free (ir_senders, TRUE, TRUE);
+  if (timeout_id > 0)
+    g_source_remove (timeout_id);
   if (context != NULL)
     libwebsocket_context_destroy (context);
+  if (lws_watches != NULL)
+    g_hash_table_destroy (lws_watches);
+  if (main_loop != NULL)
+    g_main_loop_unref (main_loop);
   if (signal_id > 0)
     g_source_remove (signal_id);
+  if (sampler_id > 0)
+    g_source_remove (sampler_id);
+  cpu_sampler_free (cpu_sampler);
+  if (stats_id > 0)
+    g_source_remove (stats_id);
+  if (stats_sync_id > 0)
+    g_source_remove (stats_sync_id);
+  /* written back one last time */
+  stat_history_free (stat_history);
+  notifications_free ();
+  if (devman != NULL)
+    devman_ctx_free (devman);
+  gpio_table_free (gpio_table);
+  if (gpio_watchers != NULL)
+    g_hash_table_destroy (gpio_watchers);
+  w1_engine_stop ();
+  proc_history_free (proc_history);
+  respcache_free (response_cache);
+  if (inflight != NULL)
+    g_hash_table_destroy (inflight);
+  lirc_client_free (lirc);
+  ir_macros_free (ir_macros);
   if (option_context != NULL)
     g_option_context_free (option_context);
 
@@ -0,0 +1,442 @@
+#include "stathist.h"
+
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define STAT_FILE_MAGIC		0x31485453	/* "STH1" */
+#define STAT_FILE_VERSION	1
+#define STAT_PAGE		4096		/* unit of the file written back */
+
+/*
+ * One ring per resolution. The bucket being filled is kept apart and
+ * pushed into the ring once a sample falls past its end, buckets are
+ * contiguous and a query walks them in order.
+ *
+ * The whole history - this header, then the rings one after another - is
+ * a single block of memory, laid out as the file. Samples are
+ * stored straight into it and queries read the buckets where they are.
+ * The file is read once when opened and only written by
+ * stat_history_sync(), page by page, the pages changed since the last one.
+ */
+struct stat_tier {
+	uint32_t resolution;		/* seconds per bucket */
+	uint32_t size;			/* slots in the ring */
+	uint32_t head;			/* slot of the next bucket */
+	uint32_t count;			/* buckets in the ring */
+	uint32_t open;			/* 'cur' has samples */
+	uint32_t pad;
+	struct stat_bucket cur;
+};
+
+struct stat_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t metrics;		/* STAT_METRICS */
+	uint32_t bucket_size;		/* sizeof(struct stat_bucket) */
+	struct stat_tier tiers[STAT_TIERS];
+};
+
+struct stat_history {
+	struct stat_header *hdr;	/* the in-memory copy */
+	size_t len;
+	int fd;				/* -1 if in memory only */
+	struct stat_bucket *rings[STAT_TIERS];
+	unsigned char *dirty;		/* per STAT_PAGE of the copy, not written yet */
+};
+
+/* seconds each tier goes back: an hour, a day, 30 days */
+static const unsigned int tier_span[STAT_TIERS] = { 3600, 86400, 30 * 86400 };
+
+static int64_t align(int64_t t, unsigned int step)
+{
+	int64_t r = t % step;
+
+	return r < 0 ? t - r - step : t - r;
+}
+
+static void agg_add(struct stat_agg *a, float v)
+{
+	if (isnan(v))
+		return;
+
+	if (a->n == 0 || v < a->min)
+		a->min = v;
+	if (a->n == 0 || v > a->max)
+		a->max = v;
+	a->sum += v;
+	a->n++;
+}
+
+static void agg_merge(struct stat_agg *a, const struct stat_agg *b)
+{
+	if (b->n == 0)
+		return;
+
+	if (a->n == 0) {
+		*a = *b;
+		return;
+	}
+
+	if (b->min < a->min)
+		a->min = b->min;
+	if (b->max > a->max)
+		a->max = b->max;
+	a->sum += b->sum;
+	a->n += b->n;
+}
+
+static void tier_add(struct stat_tier *t, struct stat_bucket *ring, int64_t now,
+		const float values[STAT_METRICS])
+{
+	int64_t start = align(now, t->resolution);
+	int i;
+
+	/* a clock set back keeps filling the open bucket */
+	if (t->open && start > t->cur.start) {
+		ring[t->head] = t->cur;
+		t->head = (t->head + 1) % t->size;
+		if (t->count < t->size)
+			t->count++;
+		t->open = 0;
+	}
+
+	if (!t->open) {
+		memset(&t->cur, 0, sizeof(t->cur));
+		t->cur.start = start;
+		t->open = 1;
+	}
+
+	for (i = 0; i < STAT_METRICS; ++i)
+		agg_add(&t->cur.v[i], values[i]);
+}
+
+/* The header a history of 'interval' has, and the length of its file. */
+static size_t layout(struct stat_header *hdr, unsigned int interval)
+{
+	const unsigned int resolution[STAT_TIERS] = { interval, 60, 3600 };
+	size_t len = sizeof(*hdr);
+	int i;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = STAT_FILE_MAGIC;
+	hdr->version = STAT_FILE_VERSION;
+	hdr->metrics = STAT_METRICS;
+	hdr->bucket_size = sizeof(struct stat_bucket);
+
+	for (i = 0; i < STAT_TIERS; ++i) {
+		hdr->tiers[i].resolution = resolution[i];
+		hdr->tiers[i].size = tier_span[i] / resolution[i];
+		len += hdr->tiers[i].size * sizeof(struct stat_bucket);
+	}
+
+	return len;
+}
+
+/* Whether a file read back is a history laid out as 'want' and in one piece. */
+static int header_valid(const struct stat_header *hdr, const struct stat_header *want)
+{
+	int i;
+
+	if (hdr->magic != want->magic || hdr->version != want->version ||
+	    hdr->metrics != want->metrics || hdr->bucket_size != want->bucket_size)
+		return 0;
+
+	for (i = 0; i < STAT_TIERS; ++i)
+		if (hdr->tiers[i].resolution != want->tiers[i].resolution ||
+		    hdr->tiers[i].size != want->tiers[i].size ||
+		    hdr->tiers[i].head >= hdr->tiers[i].size ||
+		    hdr->tiers[i].count > hdr->tiers[i].size)
+			return 0;
+
+	return 1;
+}
+
+static void mark_dirty(struct stat_history *h, const void *p, size_t len)
+{
+	size_t off = (const unsigned char *) p - (const unsigned char *) h->hdr;
+	size_t page;
+
+	for (page = off / STAT_PAGE; page <= (off + len - 1) / STAT_PAGE; ++page)
+		h->dirty[page] = 1;
+}
+
+/* Reads the whole file into the in-memory copy. */
+static int history_read(struct stat_history *h)
+{
+	unsigned char *p = (unsigned char *) h->hdr;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < h->len) {
+		n = pread(h->fd, p + done, h->len - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+
+	return 0;
+}
+
+static struct stat_history *history_open(int fd, unsigned int interval)
+{
+	struct stat_history *h;
+	struct stat_header want;
+	struct stat st;
+	unsigned char *p;
+	int i, reset = 1;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	h->fd = fd;
+	if (interval == 0 || 60 % interval != 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	h->len = layout(&want, interval);
+
+	h->dirty = calloc((h->len + STAT_PAGE - 1) / STAT_PAGE, 1);
+	if (h->dirty == NULL)
+		goto fail;
+
+	h->hdr = calloc(1, h->len);
+	if (h->hdr == NULL)
+		goto fail;
+
+	if (fd >= 0) {
+		if (fstat(fd, &st) < 0)
+			goto fail;
+		reset = (size_t) st.st_size != h->len;
+		/* blocks reserved now, syncs can't run out of space later */
+		if (reset && (ftruncate(fd, 0) < 0 || (errno = posix_fallocate(fd, 0, h->len)) != 0))
+			goto fail;
+		if (!reset && history_read(h) < 0)
+			goto fail;
+	}
+
+	/* another interval, a foreign or a torn file: start over */
+	if (reset || !header_valid(h->hdr, &want)) {
+		memset(h->hdr, 0, h->len);
+		*h->hdr = want;
+		mark_dirty(h, h->hdr, h->len);
+	}
+
+	p = (unsigned char *) (h->hdr + 1);
+	for (i = 0; i < STAT_TIERS; ++i) {
+		h->rings[i] = (struct stat_bucket *) p;
+		p += h->hdr->tiers[i].size * sizeof(struct stat_bucket);
+	}
+
+	return h;
+fail:
+	stat_history_free(h);
+	return NULL;
+}
+
+/*
+ * A history in memory only. 'interval' is the time between two samples in
+ * seconds, it has to divide a minute.
+ */
+struct stat_history *stat_history_new(unsigned int interval)
+{
+	return history_open(-1, interval);
+}
+
+/*
+ * A history kept in the file at 'path', picked up where it was left if
+ * the file holds one of the same 'interval' - and started over otherwise.
+ * Samples reach the file on stat_history_sync() only.
+ */
+struct stat_history *stat_history_open(const char *path, unsigned int interval)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	return history_open(fd, interval);
+}
+
+static int write_all(int fd, const unsigned char *p, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the pages changed since the last sync to the file - a few pages
+ * for a sync every few minutes. They go to the page cache, nothing waits
+ * for the disk here.
+ */
+int stat_history_sync(struct stat_history *h)
+{
+	size_t page, first, end, npages = (h->len + STAT_PAGE - 1) / STAT_PAGE;
+
+	if (h->fd < 0)
+		return 0;
+
+	for (page = 0; page < npages; ) {
+		if (!h->dirty[page]) {
+			++page;
+			continue;
+		}
+
+		for (first = page; page < npages && h->dirty[page]; ++page)
+			;
+		end = page * STAT_PAGE < h->len ? page * STAT_PAGE : h->len;
+		if (write_all(h->fd, (unsigned char *) h->hdr + first * STAT_PAGE,
+				end - first * STAT_PAGE, first * STAT_PAGE) < 0)
+			return -1;
+		memset(h->dirty + first, 0, page - first);
+	}
+
+	return 0;
+}
+
+/* Written back one last time, and waited for. */
+void stat_history_free(struct stat_history *h)
+{
+	int err = errno;
+
+	if (h == NULL)
+		return;
+
+	if (h->hdr != NULL) {
+		if (stat_history_sync(h) == 0 && h->fd >= 0)
+			fdatasync(h->fd);
+		free(h->hdr);
+	}
+	if (h->fd >= 0)
+		close(h->fd);
+	free(h->dirty);
+	free(h);
+	errno = err;
+}
+
+void stat_history_add(struct stat_history *h, int64_t now, const float values[STAT_METRICS])
+{
+	struct stat_tier *t;
+	uint32_t head;
+	int i;
+
+	for (i = 0; i < STAT_TIERS; ++i) {
+		t = &h->hdr->tiers[i];
+		head = t->head;
+		tier_add(t, h->rings[i], now, values);
+		if (t->head != head)
+			mark_dirty(h, &h->rings[i][head], sizeof(struct stat_bucket));
+	}
+
+	/* the open buckets */
+	mark_dirty(h, h->hdr, sizeof(*h->hdr));
+}
+
+/* Nothing from 'from' on has been pushed out of the ring yet. */
+static int tier_covers(const struct stat_tier *t, const struct stat_bucket *ring, int64_t from)
+{
+	/* once full, the slot at 'head' holds the oldest bucket */
+	return t->count < t->size || ring[t->head].start <= from;
+}
+
+/* The narrowest points on the grid of 't' for which 'maxpoints' span [from, to). */
+static int64_t tier_width(const struct stat_tier *t, int64_t from, int64_t to, unsigned int maxpoints)
+{
+	int64_t w = (to - align(from, t->resolution) + maxpoints - 1) / maxpoints;
+
+	return align(w + t->resolution - 1, t->resolution);
+}
+
+static void point_merge(struct stat_bucket *p, const struct stat_bucket *b)
+{
+	int i;
+
+	for (i = 0; i < STAT_METRICS; ++i)
+		agg_merge(&p->v[i], &b->v[i]);
+}
+
+/*
+ * Fills 'points' with at most 'maxpoints' buckets covering [from, to), in
+ * time order, and sets '*width' to their length in seconds. Points are
+ * merged from the tier which still reaches back to 'from' and gives the
+ * narrowest points - the coarser one on a tie, it has fewer buckets to
+ * read. They are aligned to the grid of that tier and those with no
+ * samples are left out. Points hold sums - the average is sum / n.
+ * Returns the number of points.
+ */
+int stat_history_query(const struct stat_history *h, int64_t from, int64_t to,
+		unsigned int maxpoints, struct stat_bucket *points, unsigned int *width)
+{
+	const struct stat_tier *t = NULL;
+	const struct stat_bucket *b, *ring = NULL;
+	int64_t base, w = 0, tw, start;
+	unsigned int i, n = 0;
+	int k;
+
+	if (maxpoints > STAT_MAX_POINTS)
+		maxpoints = STAT_MAX_POINTS;
+	if (to <= from || maxpoints == 0)
+		return 0;
+
+	/* the coarsest tier is the fallback for ranges older than all of them */
+	for (k = STAT_TIERS - 1; k >= 0; --k) {
+		if (t != NULL && !tier_covers(&h->hdr->tiers[k], h->rings[k], from))
+			continue;
+		tw = tier_width(&h->hdr->tiers[k], from, to, maxpoints);
+		if (t == NULL || tw < w) {
+			t = &h->hdr->tiers[k];
+			ring = h->rings[k];
+			w = tw;
+		}
+	}
+
+	base = align(from, t->resolution);
+
+	for (i = 0; i <= t->count; ++i) {
+		if (i < t->count)
+			b = &ring[(t->head + t->size - t->count + i) % t->size];
+		else if (t->open)
+			b = &t->cur;
+		else
+			break;
+
+		if (b->start < base || b->start >= to)
+			continue;
+
+		start = base + (b->start - base) / w * w;
+		if (n == 0 || points[n - 1].start != start) {
+			if (n == maxpoints)
+				break;
+			memset(&points[n], 0, sizeof(points[n]));
+			points[n++].start = start;
+		}
+		point_merge(&points[n - 1], b);
+	}
+
+	*width = w;
+	return n;
+}
@@ -0,0 +1,61 @@
+#ifndef __STATHIST_H
+#define __STATHIST_H
+#include <stdint.h>
+
+/*
+ * Time series of the system statistics. Every sample goes into three
+ * rings of fixed size buckets - one per sample interval, per minute and
+ * per hour - each bucket keeping min, max and sum of every metric, so a
+ * query over any range reads at most a few thousand buckets of the tier
+ * whose resolution fits it and merges them.
+ *
+ * Times are UNIX seconds. A metric which could not be read is passed as
+ * NAN and left out of its bucket.
+ *
+ * The history can be kept in a file, preallocated to its full size, to
+ * survive restarts. It is read into memory once; adding a sample is a
+ * store into that memory with no system call, and the file is only
+ * written by stat_history_sync() - the pages changed since the last one,
+ * at whatever rate the caller picks, as an SD card wears with every write.
+ * What was added since the last one is lost if the system goes down before
+ * stat_history_free(). The file is in host byte order and only meant to be
+ * read back by the same build.
+ */
+
+enum stat_metric {
+	STAT_RAM,			/* % used */
+	STAT_SWAP,			/* % used */
+	STAT_CPU,			/* % busy, all cores */
+	STAT_CPU_TEMP,			/* degrees C */
+	STAT_LOAD,			/* 1 minute load average */
+	STAT_DISK,			/* % of / used */
+	STAT_METRICS
+};
+
+#define STAT_TIERS		3
+#define STAT_MAX_POINTS		1000	/* per query */
+#define STAT_FILE_DEFAULT_PATH	"/var/lib/raspberry-control/stats"
+
+struct stat_agg {
+	float min;
+	float max;
+	float sum;
+	unsigned int n;			/* samples, 0 if there were none */
+};
+
+struct stat_bucket {
+	int64_t start;
+	struct stat_agg v[STAT_METRICS];
+};
+
+struct stat_history;
+
+struct stat_history *stat_history_new(unsigned int interval);
+struct stat_history *stat_history_open(const char *path, unsigned int interval);
+int stat_history_sync(struct stat_history *h);
+void stat_history_free(struct stat_history *h);
+void stat_history_add(struct stat_history *h, int64_t now, const float values[STAT_METRICS]);
+int stat_history_query(const struct stat_history *h, int64_t from, int64_t to,
+		unsigned int maxpoints, struct stat_bucket *points, unsigned int *width);
+
+#endif /* __STATHIST_H */
@@ -0,0 +1,89 @@
+#include "uidcache.h"
+
+#include <pwd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PASSWD_PATH "/etc/passwd"
+#define UID_CACHE_SIZE 256		/* power of 2, at most half full */
+
+struct uid_slot {
+	int used;
+	uid_t uid;
+	char *name;			/* NULL if the uid has no passwd entry */
+};
+
+static struct {
+	struct uid_slot slots[UID_CACHE_SIZE];
+	unsigned int used;
+	time_t last_check;
+	struct timespec mtime;
+} cache;
+
+void uid_cache_flush(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < UID_CACHE_SIZE; ++i) {
+		free(cache.slots[i].name);
+		cache.slots[i].name = NULL;
+		cache.slots[i].used = 0;
+	}
+	cache.used = 0;
+}
+
+/* Drops every entry if /etc/passwd has been modified since the last check. */
+static void uid_cache_validate(void)
+{
+	struct stat st;
+	time_t now = time(NULL);
+
+	if (now == cache.last_check)
+		return;
+	cache.last_check = now;
+
+	if (stat(PASSWD_PATH, &st) < 0)
+		return;
+
+	if (st.st_mtim.tv_sec != cache.mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != cache.mtime.tv_nsec) {
+		uid_cache_flush();
+		cache.mtime = st.st_mtim;
+	}
+}
+
+const char *uid_to_name(uid_t uid)
+{
+	struct uid_slot *slot;
+	struct passwd *pw;
+	unsigned int i;
+
+	uid_cache_validate();
+
+	i = ((uint32_t) uid * 2654435761u) & (UID_CACHE_SIZE - 1);
+	while (cache.slots[i].used && cache.slots[i].uid != uid)
+		i = (i + 1) & (UID_CACHE_SIZE - 1);
+
+	slot = &cache.slots[i];
+	if (slot->used)
+		return slot->name;
+
+	pw = getpwuid(uid);
+
+	/* keep the table sparse, an overflow just means a fresh start */
+	if ((cache.used + 1) * 2 > UID_CACHE_SIZE) {
+		uid_cache_flush();
+		return pw ? pw->pw_name : NULL;
+	}
+
+	slot->used = 1;
+	slot->uid = uid;
+	slot->name = pw ? strdup(pw->pw_name) : NULL;
+	++cache.used;
+
+	return slot->name;
+}
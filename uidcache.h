@@ -0,0 +1,14 @@
+#ifndef __UIDCACHE_H
+#define __UIDCACHE_H
+#include <sys/types.h>
+
+/*
+ * uid -> user name cache for the process listing. Names are resolved with
+ * getpwuid() once and kept until /etc/passwd changes (its mtime is checked
+ * at most once per second). Unknown uids are cached as well, NULL is
+ * returned for them. The returned string stays valid until the next call.
+ */
+const char *uid_to_name(uid_t uid);
+void uid_cache_flush(void);
+
+#endif /* __UIDCACHE_H */
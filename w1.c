@@ -0,0 +1,281 @@
+#include "w1.h"
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <assert.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define W1_MASTER_DIR	"/sys/bus/w1/devices/w1_bus_master1"
+#define W1_DEVICES_DIR	"/sys/devices/w1_bus_master1"
+
+/*
+ * Supported 1-wire temperature sensors
+ */
+#define DS18B20_CODE	"28"
+#define DS1820_CODE	"10"
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+	bool rescan;
+	unsigned int read_interval;
+	unsigned int rescan_interval;
+	int error;		/* errno of the last failed bus listing */
+	int n;
+	struct w1_reading sensors[W1_MAX_SENSORS];
+} w1 = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *w1_sensor_type(const char *id)
+{
+	if (strncmp(id, DS18B20_CODE, 2) == 0)
+		return "Dallas DS18B20";
+	if (strncmp(id, DS1820_CODE, 2) == 0)
+		return "Dallas DS1820";
+	return NULL;
+}
+
+/* Drops every registered slave and asks the master to search the bus again. */
+static int w1_force_rescan(void)
+{
+	FILE *fd, *fp;
+	char line[32];
+
+	fd = fopen(W1_MASTER_DIR "/w1_master_slaves", "r");
+	if (fd == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fd)) {
+		fp = fopen(W1_MASTER_DIR "/w1_master_remove", "w");
+		if (fp == NULL) {
+			fclose(fd);
+			return -1;
+		}
+		fprintf(fp, "%s", line);
+		fclose(fp);
+	}
+	fclose(fd);
+
+	fd = fopen(W1_MASTER_DIR "/w1_master_search", "w");
+	if (fd == NULL)
+		return -1;
+	fprintf(fd, "1");
+	fclose(fd);
+
+	/* we have to wait till all sensors will be available on bus */
+	sleep(1);
+	return 0;
+}
+
+static int w1_list_slaves(char ids[][20], int max)
+{
+	DIR *dir;
+	struct dirent *ent;
+	int n = 0;
+
+	dir = opendir(W1_DEVICES_DIR);
+	if (dir == NULL)
+		return -1;
+
+	for (ent = readdir(dir); ent && n < max; ent = readdir(dir)) {
+		if (ent->d_type != DT_DIR || w1_sensor_type(ent->d_name) == NULL)
+			continue;
+		snprintf(ids[n++], 20, "%.19s", ent->d_name);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+/* Blocks for the whole conversion time of the sensor (~750ms for DS18B20). */
+static int w1_read_sensor(const char *id, double *temp, char crc[4])
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	char line[100];
+	char *p;
+	int found = 0;
+
+	snprintf(path, PATH_MAX, W1_DEVICES_DIR "/%s/w1_slave", id);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if ((p = strstr(line, "crc=")) && (p = strchr(p, ' '))) {
+			snprintf(crc, 4, "%.3s", p + 1);
+			crc[strcspn(crc, "\n")] = '\0';
+			found |= 1;
+		} else if ((p = strstr(line, "t="))) {
+			*temp = atof(p + 2) / 1000;
+			found |= 2;
+		}
+	}
+
+	fclose(fp);
+	return found == 3 ? 0 : -1;
+}
+
+static struct w1_reading *w1_find(const char *id)
+{
+	int i;
+
+	for (i = 0; i < w1.n; ++i)
+		if (strcmp(w1.sensors[i].id, id) == 0)
+			return &w1.sensors[i];
+	return NULL;
+}
+
+/* Replaces the sensor list, keeping cached readings of the sensors still present. */
+static void w1_update_slaves(char ids[][20], int n)
+{
+	struct w1_reading sensors[W1_MAX_SENSORS];
+	struct w1_reading *old;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		old = w1_find(ids[i]);
+		if (old) {
+			sensors[i] = *old;
+			continue;
+		}
+		memset(&sensors[i], 0, sizeof(sensors[i]));
+		snprintf(sensors[i].id, sizeof(sensors[i].id), "%.*s", (int) sizeof(sensors[i].id) - 1, ids[i]);
+		sensors[i].type = w1_sensor_type(ids[i]);
+	}
+
+	memcpy(w1.sensors, sensors, n * sizeof(*sensors));
+	w1.n = n;
+}
+
+static void *w1_engine_thread(void *arg)
+{
+	char ids[W1_MAX_SENSORS][20];
+	struct w1_reading *r;
+	struct timespec now, deadline;
+	time_t last_rescan = 0;
+	bool do_rescan;
+	double temp;
+	char crc[4];
+	int i, n, err;
+
+	(void)arg;
+
+	pthread_mutex_lock(&w1.lock);
+	while (!w1.stop) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		do_rescan = w1.rescan && (last_rescan == 0 ||
+				now.tv_sec - last_rescan >= (time_t)w1.rescan_interval);
+		pthread_mutex_unlock(&w1.lock);
+
+		if (do_rescan) {
+			w1_force_rescan();
+			last_rescan = now.tv_sec;
+		}
+
+		/* picks up hotplugged sensors found by the kernel's own searches */
+		n = w1_list_slaves(ids, W1_MAX_SENSORS);
+		err = n < 0 ? errno : 0;
+
+		pthread_mutex_lock(&w1.lock);
+		w1.error = err;
+		w1_update_slaves(ids, n < 0 ? 0 : n);
+		pthread_mutex_unlock(&w1.lock);
+
+		for (i = 0; i < n; ++i) {
+			if (w1_read_sensor(ids[i], &temp, crc) < 0)
+				continue;
+
+			pthread_mutex_lock(&w1.lock);
+			r = w1_find(ids[i]);
+			if (r) {
+				r->temp = temp;
+				memcpy(r->crc, crc, sizeof(r->crc));
+				r->timestamp = time(NULL);
+			}
+			pthread_mutex_unlock(&w1.lock);
+		}
+
+		pthread_mutex_lock(&w1.lock);
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += w1.read_interval;
+		while (!w1.stop)
+			if (pthread_cond_timedwait(&w1.cond, &w1.lock, &deadline) == ETIMEDOUT)
+				break;
+	}
+	pthread_mutex_unlock(&w1.lock);
+
+	return NULL;
+}
+
+int w1_engine_start(bool rescan, unsigned int read_interval, unsigned int rescan_interval)
+{
+	pthread_condattr_t attr;
+	int r;
+
+	assert(!w1.running);
+
+	/* 0: the kernel's own searches only */
+	w1.rescan = rescan && rescan_interval > 0;
+	w1.read_interval = read_interval ? read_interval : 1;
+	w1.rescan_interval = rescan_interval;
+	w1.stop = false;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w1.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	r = pthread_create(&w1.thread, NULL, w1_engine_thread, NULL);
+	if (r) {
+		pthread_cond_destroy(&w1.cond);
+		errno = r;
+		return -1;
+	}
+
+	w1.running = true;
+	return 0;
+}
+
+void w1_engine_stop(void)
+{
+	if (!w1.running)
+		return;
+
+	pthread_mutex_lock(&w1.lock);
+	w1.stop = true;
+	pthread_cond_signal(&w1.cond);
+	pthread_mutex_unlock(&w1.lock);
+
+	pthread_join(w1.thread, NULL);
+	pthread_cond_destroy(&w1.cond);
+	w1.running = false;
+}
+
+/* Copies the cached readings, returns their number or -1 if the bus is gone. */
+int w1_engine_readings(struct w1_reading *readings, int max)
+{
+	int n;
+
+	pthread_mutex_lock(&w1.lock);
+	if (w1.error) {
+		errno = w1.error;
+		pthread_mutex_unlock(&w1.lock);
+		return -1;
+	}
+	n = w1.n < max ? w1.n : max;
+	memcpy(readings, w1.sensors, n * sizeof(*readings));
+	pthread_mutex_unlock(&w1.lock);
+
+	return n;
+}
@@ -0,0 +1,28 @@
+#ifndef __W1_H
+#define __W1_H
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Asynchronous 1-wire temperature acquisition. A background thread keeps
+ * reading every DS18B20/DS1820 sensor on w1_bus_master1 and caches the last
+ * reading of each one, so callers never wait for a conversion. The bus is
+ * rescanned on a schedule (rescan_interval, 0 for none) and whenever the
+ * set of slaves registered by the kernel changes.
+ */
+
+#define W1_MAX_SENSORS 32
+
+struct w1_reading {
+	char id[20];		/* e.g. "28-000002f218f8" */
+	const char *type;	/* "Dallas DS18B20" / "Dallas DS1820" */
+	double temp;		/* degrees Celsius */
+	char crc[4];		/* "YES" / "NO" as reported by w1_therm */
+	time_t timestamp;	/* time of the last read, 0 if never read */
+};
+
+int w1_engine_start(bool rescan, unsigned int read_interval, unsigned int rescan_interval);
+void w1_engine_stop(void);
+int w1_engine_readings(struct w1_reading *readings, int max);
+
+#endif /* __W1_H */